@@ -3,6 +3,21 @@
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ctype.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86
+#endif
 
 
 #define error_check(err, msg)                                        \
@@ -15,28 +30,186 @@ do {                                                                 \
 } while(0)
         
 
+/*  Cache line layout: hot monitor fields get lines of their own
+    and pizza state is kept as structure of arrays, -DCACHE_LAYOUT
+*/
+#define CACHE_LINE 64
+#ifdef CACHE_LAYOUT
+#define HOT __attribute__((aligned(CACHE_LINE)))
+
+//neighbour pizzas of a 256 block are a line apart in 4-byte arrays
+#define SWIZZLE(n) (((n) & ~255) | (((n) & 15) << 4) | (((n) >> 4) & 15))
+#define PIZ(mon, n)          ((mon)->piz[SWIZZLE(n)])
+#define PIZ_I(mon, n)        ((mon)->icomp[SWIZZLE(n)])
+#define PIZ_NODE(mon, n)     ((mon)->node[SWIZZLE(n)])
+#define PIZ_HAVE(mon, n, t)  ((mon)->have[t][SWIZZLE(n)])
+#define PIZ_WORD(mon, n)     ((mon)->words[SWIZZLE(n)])
+#else
+#define HOT
+
+#define PIZ(mon, n)          ((mon)->pizzas[n].piz)
+#define PIZ_I(mon, n)        ((mon)->pizzas[n].i)
+#define PIZ_NODE(mon, n)     ((mon)->pizzas[n].node)
+#define PIZ_HAVE(mon, n, t)  ((mon)->pizzas[n].have[t])
+#define PIZ_WORD(mon, n)     ((mon)->words[n])
+#endif
+
+//pizzas are kept in a ring of depth cells
+#define CELL(mon, n) ((int) ((n) % (mon)->depth))
+
+
+enum ENGINE
+{
+    CLASSIC,
+    PIPE,
+    LOCKFREE
+};
+
+enum
+{
+    DEPTH = 1024,   // pizza cells by default
+    SPIN  = 100,    // polls before going to sleep
+    BATCH = 1024,   // pizzas taken by checker at once
+};
+
+//components, cheeses and hams of a good pizza packed as bytes
+#define GOOD_COUNTS (3 | 1 << 8 | 2 << 16)
+
+enum
+{
+    TYPES_MAX = 4,          // kinds of ingredients
+    PIZ_MAX   = 8,          // ingredients of a pizza and '\0'
+    NAME_LEN  = 16,
+    NODES_MAX = 1 << 15,    // prefixes of allowed orderings
+};
+
+/*  Lock-free pizza word: node of claimed prefix, placed ingredients
+    and the lap of the ring the cell is ready for
+*/
+enum
+{
+    NODE_MASK    = NODES_MAX - 1,
+    PLACED_SHIFT = 15,
+    PLACED_MASK  = 7,
+    LAP_SHIFT    = 18,
+};
+
+/*  Ingredients, their counts and allowed orderings. Orderings are compiled
+    into a trie, node 0 is an empty pizza and next[] gives the node after
+    one more ingredient or -1 if it is not allowed there
+*/
+struct recipe
+{
+    int           ntypes;
+    int           total;
+    char          name[TYPES_MAX][NAME_LEN];
+    char          sym[TYPES_MAX];
+    int           count[TYPES_MAX];
+    int           workers[TYPES_MAX];
+    signed char   type[256];        // type of symbol or -1
+    int           any;              // every ordering is allowed
+    int           fast;             // 2 hams and 1 cheese in any order
+
+    int           nnodes;
+    int*          next;             // [node * ntypes + type]
+    unsigned char len[NODES_MAX];
+    unsigned char done[NODES_MAX];  // node is a whole allowed pizza
+    unsigned char have[NODES_MAX][TYPES_MAX];
+
+    char          orders[NODES_MAX / 4][PIZ_MAX];
+    int           norders;
+};
+
+#define NEXT(node, t) (recipe.next[(node) * recipe.ntypes + (t)])
+
 struct pizza
 {
-    char piz[4];
+    char piz[PIZ_MAX];
     int  i;
-    int  cheese;
-    int  ham;
+    int  node;
+    int  have[TYPES_MAX];
+};
+
+/*  Pizza in flight in pipelined mode
+*/
+struct slot
+{
+    long pizza;     // -1 if slot is free
+    int  placed;    // ingredients already put, not only claimed
+};
+
+/*  Single producer single consumer ring of completed pizzas
+*/
+struct ring
+{
+    HOT long head;
+    HOT long tail;
+    long*    items;
+};
+
+/*  First pizza which may still need an ingredient of one type
+*/
+struct cursor
+{
+    HOT long n;
+};
+
+/*  Worker putting ingredients of one type
+*/
+struct job
+{
+    struct monitor* mon;
+    int             type;
+    int             index;  // among workers of the type
 };
 
 struct monitor
 {
+#ifdef CACHE_LAYOUT
+    char        (*piz)[PIZ_MAX];
+    int*          icomp;
+    int*          node;
+    int*          have[TYPES_MAX];
+#else
     struct pizza* pizzas;
-    int           npizzas;
-    int           nmade;
-    int           ncheck;
-
-    pthread_cond_t  cond_cheese;
-    pthread_cond_t  cond_ham;
+#endif
+    int           depth;
+    long          npizzas;
+    HOT long      nmade;
+    HOT long      ncheck;
+    HOT long      good;
+    long          bad;
+
+    //cells of the batch taken by checker are freed on the next check
+    long          taken[BATCH];
+    int           ntaken;
+
+    //pipelined mode, completed pizzas wait for checker in queue
+    struct slot*  slots;
+    long*         queue;
+    char*         busy;
+    HOT int       nslots;
+    long          nopen;
+    int           ncell_wait;
+
+    //lock-free mode, words[] are changed with CAS only,
+    //futex sleeps on 32-bit sequences of made and freed pizzas
+    long*         words;
+    struct ring*  rings;
+    int           nrings;
+    int           nworkers;
+    struct cursor cursors[TYPES_MAX];
+    HOT int       free_seq;
+    int           nsleep;
+    HOT int       made_seq;
+    int           check_sleep;
+
+    HOT pthread_cond_t cond_put[TYPES_MAX];
     pthread_cond_t  cond_check;
-    pthread_mutex_t mutex;
+    pthread_cond_t  cond_queue;
+    HOT pthread_mutex_t mutex;
 
-    int (*put_cheese)(struct monitor*);
-    int (*put_ham)(struct monitor*);
+    HOT int (*put)(struct monitor*, const int);
     int (*is_ready)(struct monitor*);
     int (*check_pizza)(struct monitor*);
     int (*all_ready)(struct monitor*);
@@ -44,26 +217,255 @@ struct monitor
 };
 
 char* progname;
+long  work = 0;     // spin iterations to put one ingredient
+int   quiet = 0;
+
+struct recipe recipe;
+
+/*  Batch checker kernels, good[] gets 1 for each good pizza
+*/
+typedef int (*kernel_t)(const unsigned*, const unsigned*, unsigned char*, const int);
 
+int kernel_scalar(const unsigned* piz, const unsigned* counts, unsigned char* good, const int n);
+#ifdef X86
+int kernel_sse2(const unsigned* piz, const unsigned* counts, unsigned char* good, const int n);
+int kernel_avx2(const unsigned* piz, const unsigned* counts, unsigned char* good, const int n);
+#endif
 
-void monitor_init(struct monitor*, const int);
+struct kernel
+{
+    const char* name;
+    kernel_t    check;
+};
+
+struct kernel kernels[] = {
+#ifdef X86
+    {"avx2", kernel_avx2},
+    {"sse2", kernel_sse2},
+#endif
+    {"scalar", kernel_scalar},
+};
+
+kernel_t kernel = NULL;
+
+/*  Counters of --perf, the ones kernel does not support are skipped
+*/
+struct counter
+{
+    const char* name;
+    __u32       type;
+    __u64       config;
+    int         fd;
+};
+
+#define HW_CACHE(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+struct counter counters[] = {
+    {"cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+    {"cache references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1},
+    {"L1d load misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+              PERF_COUNT_HW_CACHE_RESULT_MISS), -1},
+    {"LLC load misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+              PERF_COUNT_HW_CACHE_RESULT_MISS), -1},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+    {"context switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1},
+    {"cpu migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, -1},
+    {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1},
+};
+
+__thread struct ring* ring = NULL;
+
+/*  Monitor profiling, -DPROFILE prints a table of lock and wait times
+    per thread at exit and -DPROFILE_JSON prints the same as JSON.
+    Without them the monitor calls go straight to pthreads
+*/
+#if defined(PROFILE_JSON) && !defined(PROFILE)
+#define PROFILE
+#endif
+
+#ifdef PROFILE
+enum
+{
+    PROF_MAX = 1024,    // profiled threads
+};
+
+struct prof
+{
+    char name[NAME_LEN + 16];
+    long locks;         // mutex acquisitions
+    long lock_ns;       // spent acquiring the mutex
+    long hold_ns;       // mutex held, waits excluded
+    long waits;
+    long wait_ns;       // blocked in condition or futex wait
+    long wasted;        // woken only to wait again
+    long since;         // mutex taken or wait left at
+    int  woken;         // woken and not done anything yet
+};
+
+struct prof profs[PROF_MAX];
+int         nprofs = 0;
+__thread struct prof* prof = NULL;
+#endif
+
+
+void monitor_init(struct monitor*, const long, const int, const int, const int, const int);
 void monitor_clear(struct monitor*);
 
-void* cheeser(void* arg);
-void* hammer (void* arg);
+int  recipe_parse(const char* text);
+int  recipe_file(const char* path);
+int  recipe_compile();
+int  recipe_orders(char* piz, int* left, const int pos);
+int  recipe_insert(const char* piz);
+int  recipe_walk(const char* piz);
+
+void* worker (void* arg);
 void* checker(void* arg);
 
-int put_cheese(struct monitor*);
-int put_ham(struct monitor*);
+int put(struct monitor*, const int);
 int check_pizza(struct monitor*);
 int is_ready(struct monitor*);
+int is_full(struct monitor*);
 int all_ready(struct monitor*);
 int all_check(struct monitor*);
 
+int pipe_check(struct monitor*);
+int pipe_put(struct monitor*, const int);
+int pipe_claim(struct monitor*, const int, int*);
+int pipe_need(struct monitor*, const int, const int);
+int pipe_open(struct monitor*, const int);
+void pipe_wake(struct monitor*, const int, const int, const int);
+
+int  lf_check(struct monitor*);
+int  lf_put(struct monitor*, const int);
+void lf_done(struct monitor*, const long, const long);
+void futex_wait(int* addr, int* waiters, int val);
+int  monitor_lock(struct monitor*);
+int  monitor_unlock(struct monitor*);
+int  monitor_wait(struct monitor*, pthread_cond_t*);
+void prof_start(const char* name, const int index);
+void prof_done();
+void prof_report();
+void futex_wake(int* addr, int* waiters, int n);
+
+void   pizza_verdict(struct monitor*, const long);
+void   pizza_recycle(struct monitor*, const int);
+void   batch_verdict(struct monitor*, const long*, const int);
+int    table_check(struct monitor*, const int);
+int    batch_free(struct monitor*);
+void*  alloc_lines(size_t size);
+void   perf_start();
+void   perf_report(const long);
+void   assemble();
+int    parse_arg(const char* arg, const char* name);
+double get_time();
+long   get_ns();
+
 
 int main(int argc, char* argv[])
 {
     progname = argv[0];
+
+    struct option longopts[] = {
+        {"hammers", required_argument, NULL, 'H'},
+        {"cheesers", required_argument, NULL, 'C'},
+        {"pipeline", required_argument, NULL, 'p'},
+        {"work", required_argument, NULL, 'w'},
+        {"time", no_argument, NULL, 't'},
+        {"lockfree", no_argument, NULL, 'l'},
+        {"perf", no_argument, NULL, 'P'},
+        {"depth", required_argument, NULL, 'd'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"kernel", required_argument, NULL, 'k'},
+        {"recipe", required_argument, NULL, 'r'},
+        {"recipe-file", required_argument, NULL, 'f'},
+        {0, 0, 0, 0}
+    };
+
+    int nhammers = 0;
+    int ncheesers = 0;
+    const char* text = NULL;
+    const char* path = NULL;
+    int nslots = 0;
+    int timing = 0;
+    int engine = CLASSIC;
+    int perf = 0;
+    int depth = DEPTH;
+
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, "H:C:p:w:tlPd:qk:r:f:", longopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'H':
+                nhammers = parse_arg(optarg, "number of hammers");
+                if (!nhammers)
+                    return 0;
+                break;
+            case 'C':
+                ncheesers = parse_arg(optarg, "number of cheesers");
+                if (!ncheesers)
+                    return 0;
+                break;
+            case 'p':
+                nslots = parse_arg(optarg, "number of pizzas in flight");
+                if (!nslots)
+                    return 0;
+                if (engine == CLASSIC)
+                    engine = PIPE;
+                break;
+            case 'l':
+                engine = LOCKFREE;
+                break;
+            case 'P':
+                perf = 1;
+                break;
+            case 'd':
+                depth = parse_arg(optarg, "depth");
+                if (!depth)
+                    return 0;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'r':
+                text = optarg;
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            case 'k':
+            {
+                size_t i = 0;
+                size_t n = sizeof(kernels) / sizeof(kernels[0]);
+                while (i < n && strcmp(optarg, kernels[i].name))
+                    i++;
+                if (i == n)
+                {
+                    printf("%s: unknown kernel: %s\n", progname, optarg);
+                    return 0;
+                }
+                kernel = kernels[i].check;
+                break;
+            }
+            case 'w':
+                work = parse_arg(optarg, "work");
+                if (!work)
+                    return 0;
+                break;
+            case 't':
+                timing = 1;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc != 2)
     {
         printf("%s: wrong number of arguments: %d, expected: 1\n",
@@ -71,99 +473,480 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    const int npizzas = (int) strtol(argv[1], 0, 0);
-    if (npizzas <= 0)
+    char* end = NULL;
+    errno = 0;
+    const long npizzas = strtol(argv[1], &end, 0);
+    if (errno || *end || npizzas <= 0)
     {
         printf("%s: argument must be positive\n", progname);
         return 0;
     }
 
+    //every pizza in flight or in queue keeps its cell
+    if (engine == PIPE && 2 * nslots > depth)
+    {
+        printf("%s: depth %d is less than twice the pizzas in flight %d\n",
+               progname, depth, nslots);
+        return 0;
+    }
+
+    int ok = path ? recipe_file(path) : recipe_parse(text ? text : "ham:2:2,cheese:1:1");
+    if (!ok || !recipe_compile())
+        return 0;
+
+    //pools of the default ingredients
+    if (nhammers && recipe.type['h'] != -1)
+        recipe.workers[(int) recipe.type['h']] = nhammers;
+    if (ncheesers && recipe.type['c'] != -1)
+        recipe.workers[(int) recipe.type['c']] = ncheesers;
+
+    int nworkers = 0;
+    for (int t = 0; t < recipe.ntypes; t++)
+        nworkers += recipe.workers[t];
+
+    if (!kernel)
+    {
+        kernel = kernel_scalar;
+#ifdef X86
+        __builtin_cpu_init();
+        kernel = __builtin_cpu_supports("avx2") ? kernel_avx2 : kernel_sse2;
+#endif
+    }
+
     struct monitor mon;
-    monitor_init(&mon, npizzas);
+    monitor_init(&mon, npizzas, depth, engine, nslots, nworkers);
 
-    pthread_t thrid[4];
+    const int nthreads = nworkers + 1;
+    pthread_t* thrid = (pthread_t*) calloc(sizeof(pthread_t), nthreads);
+    struct job* jobs = (struct job*) calloc(sizeof(struct job), nworkers);
+    assert(thrid && jobs);
     int err = 0;
 
-    for (int i = 0; i < 2; i++)
+    //counters inherit to threads created after
+    if (perf)
+        perf_start();
+    double start = get_time();
+
+    int i = 0;
+    for (int t = 0; t < recipe.ntypes; t++)
     {
-        err = pthread_create(thrid + i, NULL, hammer, &mon);
-        error_check(err, "hammer create");
+        for (int j = 0; j < recipe.workers[t]; j++, i++)
+        {
+            jobs[i].mon = &mon;
+            jobs[i].type = t;
+            jobs[i].index = j;
+            err = pthread_create(thrid + i, NULL, worker, jobs + i);
+            error_check(err, "worker create");
+        }
     }
-    
-    err = pthread_create(thrid + 2, NULL, cheeser, &mon);
-    error_check(err, "cheeser create");
 
-    err = pthread_create(thrid + 3, NULL, checker, &mon);
+    err = pthread_create(thrid + nthreads - 1, NULL, checker, &mon);
     error_check(err, "checker create");
 
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < nthreads; i++)
         pthread_join(thrid[i], NULL);
+
+    double time = get_time() - start;
+    printf("Good: %ld, bad: %ld\n", mon.good, mon.bad);
+    if (quiet)
+        printf("%ld pizzas in %.3lf s, %.0lf pizzas/s\n",
+               npizzas, time, npizzas / time);
+    else if (timing)
+        fprintf(stderr, "%ld pizzas in %.3lf s, %.0lf pizzas/s\n",
+                npizzas, time, npizzas / time);
+    if (perf)
+        perf_report(npizzas);
+#ifdef PROFILE
+    prof_report();
+#endif
     
+    free(thrid);
+    free(jobs);
     monitor_clear(&mon);
+    free(recipe.next);
 
     return 0;
 }
 
 
-void monitor_init(struct monitor* mon, const int npizzas)
+/*  Classic engine makes one pizza at a time and ignores nslots,
+    lock-free one needs the number of workers to give each a ring.
+    Memory depends on depth only, checked pizzas give cells to new ones
+*/
+void monitor_init(struct monitor* mon, const long npizzas, const int depth,
+                  const int engine, const int nslots, const int nworkers)
 {
     assert(mon);
 
+    mon->depth = depth;
     mon->npizzas = npizzas;
     mon->nmade = 0;
     mon->ncheck = 0;
-    mon->pizzas = (struct pizza*) calloc(sizeof(struct pizza), npizzas);
+    mon->good = 0;
+    mon->bad = 0;
+#ifdef CACHE_LAYOUT
+    //whole 256 blocks for swizzled index
+    size_t nalloc = (depth + 255) & ~255;
+    mon->piz = (char (*)[PIZ_MAX]) alloc_lines(nalloc * sizeof(mon->piz[0]));
+    mon->icomp = (int*) alloc_lines(nalloc * sizeof(int));
+    mon->node = (int*) alloc_lines(nalloc * sizeof(int));
+    for (int t = 0; t < TYPES_MAX; t++)
+        mon->have[t] = (int*) alloc_lines(nalloc * sizeof(int));
+#else
+    size_t nalloc = depth;
+    mon->pizzas = (struct pizza*) calloc(sizeof(struct pizza), depth);
     assert(mon->pizzas);
+#endif
+
+    mon->nslots = nslots;
+    mon->nopen = 0;
+    mon->ntaken = 0;
+    mon->ncell_wait = 0;
+    mon->slots = NULL;
+    mon->queue = NULL;
+    mon->busy = NULL;
+    if (engine == PIPE)
+    {
+        mon->slots = (struct slot*) calloc(sizeof(struct slot), nslots);
+        mon->queue = (long*) calloc(sizeof(long), nslots);
+        mon->busy = (char*) calloc(sizeof(char), depth);
+        assert(mon->slots && mon->queue && mon->busy);
+        for (int i = 0; i < nslots; i++)
+            mon->slots[i].pizza = -1;
+    }
+
+    mon->words = NULL;
+    mon->rings = NULL;
+    mon->nrings = 0;
+    mon->nworkers = nworkers;
+    for (int t = 0; t < TYPES_MAX; t++)
+        mon->cursors[t].n = 0;
+    mon->free_seq = 0;
+    mon->nsleep = 0;
+    mon->made_seq = 0;
+    mon->check_sleep = 0;
+    if (engine == LOCKFREE)
+    {
+        mon->words = (long*) alloc_lines(nalloc * sizeof(long));
+        mon->rings = (struct ring*) alloc_lines(nworkers * sizeof(struct ring));
+        //at most depth pizzas are completed and not checked
+        for (int i = 0; i < nworkers; i++)
+        {
+            mon->rings[i].items = (long*) calloc(sizeof(long), depth);
+            assert(mon->rings[i].items);
+        }
+    }
 
     int err = pthread_mutex_init(&mon->mutex, NULL);
     error_check(err, "mutex init");
-    err = pthread_cond_init(&mon->cond_cheese, NULL);
-    error_check(err, "cond cheese init");
-    err = pthread_cond_init(&mon->cond_ham, NULL);
-    error_check(err, "cond ham init");
+    for (int t = 0; t < TYPES_MAX; t++)
+    {
+        err = pthread_cond_init(mon->cond_put + t, NULL);
+        error_check(err, "cond put init");
+    }
     err = pthread_cond_init(&mon->cond_check, NULL);
     error_check(err, "cond check init");
+    err = pthread_cond_init(&mon->cond_queue, NULL);
+    error_check(err, "cond queue init");
 
-    mon->put_cheese = put_cheese;
-    mon->put_ham = put_ham;
+    mon->put = put;
     mon->is_ready = is_ready;
     mon->check_pizza = check_pizza;
     mon->all_ready = all_ready;
     mon->all_check = all_check;
+
+    if (engine == PIPE)
+    {
+        mon->put = pipe_put;
+        mon->check_pizza = pipe_check;
+    }
+    else if (engine == LOCKFREE)
+    {
+        mon->put = lf_put;
+        mon->check_pizza = lf_check;
+    }
 }
 
 
 void monitor_clear(struct monitor* mon)
 {
     assert(mon);
+#ifdef CACHE_LAYOUT
+    free(mon->piz);
+    free(mon->icomp);
+    free(mon->node);
+    for (int t = 0; t < TYPES_MAX; t++)
+        free(mon->have[t]);
+#else
     free(mon->pizzas);
+#endif
+    free(mon->slots);
+    free(mon->queue);
+    free(mon->busy);
+    free(mon->words);
+    for (int i = 0; mon->rings && i < mon->nworkers; i++)
+        free(mon->rings[i].items);
+    free(mon->rings);
 
     int err = pthread_mutex_destroy(&mon->mutex);
     error_check(err, "mutex destroy");
-    err = pthread_cond_destroy(&mon->cond_cheese);
-    error_check(err, "cond cheese destroy");
-    err = pthread_cond_destroy(&mon->cond_ham);
-    error_check(err, "cond ham destroy");
+    for (int t = 0; t < TYPES_MAX; t++)
+    {
+        err = pthread_cond_destroy(mon->cond_put + t);
+        error_check(err, "cond put destroy");
+    }
+    err = pthread_cond_destroy(&mon->cond_check);
+    error_check(err, "cond check destroy");
+    err = pthread_cond_destroy(&mon->cond_queue);
+    error_check(err, "cond queue destroy");
 }
 
 
-void* cheeser(void* arg)
+/*  Recipe is a list of "name:count[:workers]" items and optional
+    "order:SEQ" ones separated by commas or new lines, the first letter
+    of a name is its symbol in pizza strings
+*/
+int recipe_parse(const char* text)
 {
-    assert(arg);
+    assert(text);
 
-    struct monitor* mon = (struct monitor*) arg;
-    while (mon->put_cheese(mon));
+    memset(&recipe, 0, sizeof(recipe));
+    memset(recipe.type, -1, sizeof(recipe.type));
 
-    return NULL;
+    char* copy = strdup(text);
+    assert(copy);
+    const char* err = NULL;
+    char* item = NULL;
+    char* save = NULL;
+
+    for (item = strtok_r(copy, ",\n", &save); item && !err; item = strtok_r(NULL, ",\n", &save))
+    {
+        while (isspace((unsigned char) *item))
+            item++;
+        char* end = item + strlen(item);
+        while (end > item && isspace((unsigned char) end[-1]))
+            *--end = '\0';
+        if (!*item || *item == '#')
+            continue;
+
+        char* rest = strchr(item, ':');
+        if (!rest)
+        {
+            err = "bad recipe item";
+            break;
+        }
+        *rest++ = '\0';
+
+        if (!strcmp(item, "order"))
+        {
+            if (recipe.norders == NODES_MAX / 4)
+                err = "too many orders";
+            else if (strlen(rest) >= PIZ_MAX)
+                err = "order is too long";
+            else
+                strcpy(recipe.orders[recipe.norders++], rest);
+            continue;
+        }
+
+        const int t = recipe.ntypes;
+        unsigned char sym = item[0];
+        char* nworkers = strchr(rest, ':');
+        if (nworkers)
+            *nworkers++ = '\0';
+
+        if (t == TYPES_MAX)
+            err = "too many ingredients";
+        else if (strlen(item) >= NAME_LEN)
+            err = "ingredient name is too long";
+        else if (recipe.type[sym] != -1 || !isgraph(sym))
+            err = "symbol is used twice";
+        if (err)
+            break;
+
+        recipe.count[t] = parse_arg(rest, "ingredient count");
+        recipe.workers[t] = nworkers ? parse_arg(nworkers, "number of workers") : 1;
+        if (!recipe.count[t] || !recipe.workers[t])
+        {
+            free(copy);
+            return 0;
+        }
+
+        strcpy(recipe.name[t], item);
+        recipe.sym[t] = sym;
+        recipe.type[sym] = t;
+        recipe.total += recipe.count[t];
+        recipe.ntypes++;
+        if (recipe.total >= PIZ_MAX)
+            err = "too many ingredients on a pizza";
+    }
+
+    if (!err && !recipe.ntypes)
+        err = "no ingredients";
+    if (err)
+        printf("%s: recipe: %s: %s\n", progname, err, item ? item : text);
+
+    free(copy);
+    return !err;
+}
+
+
+int recipe_file(const char* path)
+{
+    assert(path);
+
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        printf("%s: %s: %s\n", progname, path, strerror(errno));
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* text = (char*) calloc(1, size + 1);
+    assert(text);
+    int ok = size >= 0 && fread(text, 1, size, file) == (size_t) size;
+    if (!ok)
+        printf("%s: %s: read failed\n", progname, path);
+    fclose(file);
+
+    ok = ok && recipe_parse(text);
+    free(text);
+
+    return ok;
+}
+
+
+/*  Builds the trie of allowed orderings, all permutations if none is given.
+    Default recipe keeps the SIMD checker
+*/
+int recipe_compile()
+{
+    recipe.next = (int*) malloc(sizeof(int) * NODES_MAX * recipe.ntypes);
+    assert(recipe.next);
+    memset(recipe.next, -1, sizeof(int) * NODES_MAX * recipe.ntypes);
+    recipe.nnodes = 1;
+
+    if (!recipe.norders)
+    {
+        char piz[PIZ_MAX] = {0};
+        int left[TYPES_MAX];
+        memcpy(left, recipe.count, sizeof(left));
+        recipe.any = 1;
+        if (!recipe_orders(piz, left, 0))
+            return 0;
+    }
+
+    for (int k = 0; k < recipe.norders; k++)
+    {
+        const char* order = recipe.orders[k];
+        int have[TYPES_MAX] = {0};
+        int ok = (int) strlen(order) == recipe.total;
+        for (int j = 0; ok && order[j]; j++)
+        {
+            int t = recipe.type[(unsigned char) order[j]];
+            ok = t != -1 && ++have[t] <= recipe.count[t];
+        }
+        if (!ok)
+        {
+            printf("%s: recipe: order does not match the ingredients: %s\n", progname, order);
+            return 0;
+        }
+        if (!recipe_insert(order))
+            return 0;
+    }
+
+    int h = recipe.type['h'];
+    int c = recipe.type['c'];
+    recipe.fast = recipe.any && recipe.ntypes == 2 && h != -1 && c != -1 &&
+                  recipe.count[h] == 2 && recipe.count[c] == 1;
+
+    return 1;
+}
+
+
+/*  Inserts every ordering of the ingredients left after pos
+*/
+int recipe_orders(char* piz, int* left, const int pos)
+{
+    assert(piz && left);
+
+    if (pos == recipe.total)
+        return recipe_insert(piz);
+
+    for (int t = 0; t < recipe.ntypes; t++)
+    {
+        if (!left[t])
+            continue;
+
+        left[t]--;
+        piz[pos] = recipe.sym[t];
+        int ok = recipe_orders(piz, left, pos + 1);
+        left[t]++;
+        if (!ok)
+            return 0;
+    }
+
+    return 1;
 }
 
 
-void* hammer(void* arg)
+int recipe_insert(const char* piz)
+{
+    assert(piz);
+
+    int node = 0;
+    for (int j = 0; piz[j]; j++)
+    {
+        int t = recipe.type[(unsigned char) piz[j]];
+        if (NEXT(node, t) == -1)
+        {
+            if (recipe.nnodes == NODES_MAX)
+            {
+                printf("%s: recipe: too many orders\n", progname);
+                return 0;
+            }
+
+            int child = recipe.nnodes++;
+            recipe.len[child] = recipe.len[node] + 1;
+            memcpy(recipe.have[child], recipe.have[node], sizeof(recipe.have[0]));
+            recipe.have[child][t]++;
+            NEXT(node, t) = child;
+        }
+        node = NEXT(node, t);
+    }
+    recipe.done[node] = 1;
+
+    return 1;
+}
+
+
+/*  Node of the pizza string or -1 if no allowed ordering starts with it
+*/
+int recipe_walk(const char* piz)
+{
+    assert(piz);
+
+    int node = 0;
+    for (int j = 0; j < PIZ_MAX && piz[j] && node != -1; j++)
+    {
+        int t = recipe.type[(unsigned char) piz[j]];
+        node = t == -1 ? -1 : NEXT(node, t);
+    }
+
+    return node;
+}
+
+
+void* worker(void* arg)
 {
     assert(arg);
 
-    struct monitor* mon = (struct monitor*) arg;
-    while (mon->put_ham(mon));
+    struct job* job = (struct job*) arg;
+    prof_start(recipe.name[job->type], job->index);
+    while (job->mon->put(job->mon, job->type));
 
     return NULL;
 }
@@ -174,173 +957,966 @@ void* checker(void* arg)
     assert(arg);
 
     struct monitor* mon = (struct monitor*) arg;
+    prof_start("checker", 0);
     while (mon->check_pizza(mon));
 
     return NULL;
 }
 
 
-int put_cheese(struct monitor* mon)
+/*  Ingredient of type t goes to the current pizza when its trie node
+    allows it, the whole pizza wakes everybody for the next one
+*/
+int put(struct monitor* mon, const int t)
 {
     assert(mon);
 
-    int err = pthread_mutex_lock(&mon->mutex);
-    error_check(err, "put cheese lock");
+    int err = monitor_lock(mon);
+    error_check(err, "put lock");
     
-    if (!mon->all_ready(mon) && mon->pizzas[mon->nmade].cheese == 1)
+    while (!mon->all_ready(mon) &&
+           (is_full(mon) || NEXT(PIZ_NODE(mon, CELL(mon, mon->nmade)), t) == -1))
     {
-        err = pthread_cond_wait(&mon->cond_cheese, &mon->mutex);
-        error_check(err, "put cheese wait");
+        err = monitor_wait(mon, mon->cond_put + t);
+        error_check(err, "put wait");
     }
 
     if (!mon->all_ready(mon))
     {
-        int i = mon->pizzas[mon->nmade].i;
-        mon->pizzas[mon->nmade].piz[i] = 'c';
-        mon->pizzas[mon->nmade].i++;
-        mon->pizzas[mon->nmade].cheese++;
-
-        if (mon->is_ready(mon))
+        assemble();
+        int cell = CELL(mon, mon->nmade);
+        int i = PIZ_I(mon, cell);
+        PIZ(mon, cell)[i] = recipe.sym[t];
+        PIZ_I(mon, cell)++;
+        PIZ_HAVE(mon, cell, t)++;
+        PIZ_NODE(mon, cell) = NEXT(PIZ_NODE(mon, cell), t);
+
+        int ready = mon->is_ready(mon);
+        if (ready)
         {
             mon->nmade++;
-            err = pthread_cond_broadcast(&mon->cond_ham);
-            error_check(err, "put cheese broadcast");
-
             err = pthread_cond_signal(&mon->cond_check);
-            error_check(err, "put cheese signal check");
+            error_check(err, "put signal check");
+        }
+
+        //with fixed orderings the next one may be of another type
+        for (int k = 0; (ready || !recipe.any) && k < recipe.ntypes; k++)
+        {
+            err = pthread_cond_broadcast(mon->cond_put + k);
+            error_check(err, "put broadcast");
         }
     }
 
     int res = !mon->all_ready(mon);
 
-    err = pthread_mutex_unlock(&mon->mutex);
-    error_check(err, "put cheese unlock");
+    err = monitor_unlock(mon);
+    error_check(err, "put unlock");
 
     return res;
 }
 
 
-int put_ham(struct monitor* mon)
+/*  Takes all made pizzas up to a batch and checks them outside the lock,
+    their cells are kept till the next call
+*/
+int check_pizza(struct monitor* mon)
 {
     assert(mon);
 
-    int err = pthread_mutex_lock(&mon->mutex);
-    error_check(err, "put ham lock");
-    
-    while (!mon->all_ready(mon) && mon->pizzas[mon->nmade].ham == 2)
+    int err = monitor_lock(mon);
+    error_check(err, "check pizza lock");
+
+    //producers wait for a cell
+    int full = is_full(mon);
+    if (batch_free(mon) && full)
     {
-        err = pthread_cond_wait(&mon->cond_ham, &mon->mutex);
-        error_check(err, "put ham wait");
+        for (int t = 0; t < recipe.ntypes; t++)
+        {
+            err = pthread_cond_broadcast(mon->cond_put + t);
+            error_check(err, "check broadcast");
+        }
     }
 
-    if (!mon->all_ready(mon))
+    while (!mon->all_check(mon) && mon->ncheck == mon->nmade)
     {
-        int i = mon->pizzas[mon->nmade].i;
-        mon->pizzas[mon->nmade].piz[i] = 'h';
-        mon->pizzas[mon->nmade].i++;
-        mon->pizzas[mon->nmade].ham++;
+        err = monitor_wait(mon, &mon->cond_check);
+        error_check(err, "check wait");
+    }
     
-        if (mon->is_ready(mon))
-        {
-            mon->nmade++;
-            err = pthread_cond_signal(&mon->cond_cheese);
-            error_check(err, "put ham signal");
+    while (mon->ncheck < mon->nmade && mon->ntaken < BATCH)
+        mon->taken[mon->ntaken++] = mon->ncheck++;
 
-            err = pthread_cond_signal(&mon->cond_check);
-            error_check(err, "put ham signal check");
+    int res = !mon->all_check(mon);
+
+    err = monitor_unlock(mon);
+    error_check(err, "check unlock");
+
+    batch_verdict(mon, mon->taken, mon->ntaken);
+
+    return res;
+}
+
+
+int is_ready(struct monitor* mon)
+{
+    assert(mon);
+    return PIZ_I(mon, CELL(mon, mon->nmade)) == recipe.total;
+}
+
+
+int is_full(struct monitor* mon)
+{
+    assert(mon);
+    return mon->nmade - mon->ncheck + mon->ntaken == mon->depth;
+}
+
+
+int all_ready(struct monitor* mon)
+{
+    assert(mon);
+    return mon->nmade == mon->npizzas; 
+}
+
+
+int all_check(struct monitor* mon)
+{
+    assert(mon);
+    return mon->ncheck == mon->npizzas;
+}
+
+
+
+void pizza_verdict(struct monitor* mon, const long n)
+{
+    assert(mon);
+
+    int cell = CELL(mon, n);
+    int i = PIZ_I(mon, cell);
+    int ok = i == recipe.total;
+    if (!ok && !quiet)
+        printf("Pizza %ld is bad! It has %d components\n", n, i);
+
+    for (int t = 0; t < recipe.ntypes; t++)
+    {
+        int have = PIZ_HAVE(mon, cell, t);
+        if (have != recipe.count[t])
+        {
+            ok = 0;
+            if (!quiet)
+                printf("Pizza %ld is bad! it has %d %ss\n", n, have, recipe.name[t]);
         }
     }
+
+    int node = recipe_walk(PIZ(mon, cell));
+    int strcond = node != -1 && recipe.done[node];
+    if (!strcond && !quiet)
+        printf("Pizza %ld: \"%s\" is bad!\n", n, PIZ(mon, cell));
     
-    int res = !mon->all_ready(mon);
+    if (ok && strcond)
+    {
+        mon->good++;
+        if (!quiet)
+            printf("Pizza %ld: \"%s\" is good!\n", n, PIZ(mon, cell));
+    }
+    else
+        mon->bad++;
+}
 
-    err = pthread_mutex_unlock(&mon->mutex);
-    error_check(err, "put hum unlock");
 
-    return res;
+/*  Good pizzas are found by kernel, bad ones are told in detail
+*/
+void batch_verdict(struct monitor* mon, const long* ns, const int count)
+{
+    assert(mon && ns && count <= BATCH);
+    if (count <= 0)
+        return;
+
+    unsigned piz[BATCH];
+    unsigned counts[BATCH];
+    unsigned char good[BATCH];
+    int ngood = 0;
+
+    if (recipe.fast)
+    {
+        int c = recipe.type['c'];
+        int h = recipe.type['h'];
+        for (int j = 0; j < count; j++)
+        {
+            int cell = CELL(mon, ns[j]);
+            memcpy(piz + j, PIZ(mon, cell), sizeof(piz[0]));
+            counts[j] = PIZ_I(mon, cell) | PIZ_HAVE(mon, cell, c) << 8 | PIZ_HAVE(mon, cell, h) << 16;
+        }
+        ngood = kernel(piz, counts, good, count);
+    }
+    else
+    {
+        for (int j = 0; j < count; j++)
+        {
+            good[j] = table_check(mon, CELL(mon, ns[j]));
+            ngood += good[j];
+        }
+    }
+
+    if (ngood == count && quiet)
+    {
+        mon->good += count;
+        return;
+    }
+
+    for (int j = 0; j < count; j++)
+    {
+        if (!good[j])
+            pizza_verdict(mon, ns[j]);
+        else
+        {
+            mon->good++;
+            if (!quiet)
+                printf("Pizza %ld: \"%s\" is good!\n", ns[j], PIZ(mon, CELL(mon, ns[j])));
+        }
+    }
 }
 
 
-int check_pizza(struct monitor* mon)
+/*  Pizza of any recipe is good if its string is a whole allowed ordering
+    and the counters agree with it
+*/
+int table_check(struct monitor* mon, const int cell)
 {
     assert(mon);
 
-    int err = pthread_mutex_lock(&mon->mutex);
-    error_check(err, "check pizza lock");
+    const char* piz = PIZ(mon, cell);
+    int node = 0;
+    for (int j = 0; j < recipe.total && node != -1; j++)
+    {
+        int t = recipe.type[(unsigned char) piz[j]];
+        node = t == -1 ? -1 : NEXT(node, t);
+    }
+    if (node == -1 || !recipe.done[node] || piz[recipe.total])
+        return 0;
 
-    if (!mon->all_check(mon) && mon->ncheck == mon->nmade)
+    int ok = PIZ_I(mon, cell) == recipe.total;
+    for (int t = 0; t < recipe.ntypes; t++)
+        ok &= PIZ_HAVE(mon, cell, t) == recipe.count[t];
+
+    return ok;
+}
+
+
+/*  Frees cells of the batch taken by the previous check, under the lock
+*/
+int batch_free(struct monitor* mon)
+{
+    assert(mon);
+
+    int ntaken = mon->ntaken;
+    for (int j = 0; j < ntaken; j++)
     {
-        err = pthread_cond_wait(&mon->cond_check, &mon->mutex);
-        error_check(err, "check wait");
+        int cell = CELL(mon, mon->taken[j]);
+        pizza_recycle(mon, cell);
+        if (mon->busy)
+            mon->busy[cell] = 0;
     }
-    
-    if (!mon->all_check(mon))
-    {
-        int i = mon->pizzas[mon->ncheck].i;
-        int icond = i == 3;
-        if (!icond)
-            printf("Pizza %d is bad! It has %d components\n", 
-                   mon->ncheck, i);
-
-        int cheese = mon->pizzas[mon->ncheck].cheese;
-        int ccond = cheese == 1;
-        if (!ccond)
-            printf("Pizza %d is bad! it has %d cheeses\n", 
-                   mon->ncheck, cheese);
-
-        int ham = mon->pizzas[mon->ncheck].ham;
-        int hcond = ham == 2;
-        if (!ccond)
-            printf("Pizza %d is bad! it has %d hams\n", 
-                   mon->ncheck, ham);
+    mon->ntaken = 0;
+
+    return ntaken;
+}
+
 
+int kernel_scalar(const unsigned* piz, const unsigned* counts, unsigned char* good, const int n)
+{
+    int ngood = 0;
+    for (int k = 0; k < n; k++)
+    {
         int ccount = 0;
         int hcount = 0;
-        for (int j = 0; j < 3; j++)
+        for (int j = 0; j < 4; j++)
         {
-            char c = mon->pizzas[mon->ncheck].piz[j];
-            if (c == 'c')
-                ccount++;
-            else if (c == 'h')
-                hcount++;  
+            unsigned char c = piz[k] >> (8 * j);
+            ccount += c == 'c';
+            hcount += c == 'h';
         }
-        int strcond = (ccount == 1) && (hcount == 2);
-        if (!strcond)
-            printf("Pizza %d: \"%s\" is bad!\n",
-                   mon->ncheck, mon->pizzas[mon->ncheck].piz);
-        
-        if (icond && ccond && hcond && strcond)
-            printf("Pizza %d: \"%s\" is good!\n",
-                   mon->ncheck, mon->pizzas[mon->ncheck].piz);
+        good[k] = counts[k] == GOOD_COUNTS && ccount == 1 && hcount == 2 && !(piz[k] >> 24);
+        ngood += good[k];
+    }
+
+    return ngood;
+}
+
+
+#ifdef X86
+/*  Bytes equal to 'c' and 'h' are summed inside 32-bit lanes of piz,
+    fourth byte must be zero and counts must be the good ones
+*/
+__attribute__((target("sse2")))
+int kernel_sse2(const unsigned* piz, const unsigned* counts, unsigned char* good, const int n)
+{
+    const __m128i vc = _mm_set1_epi8('c');
+    const __m128i vh = _mm_set1_epi8('h');
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i low = _mm_set1_epi32(0xFF);
+    const __m128i top = _mm_set1_epi32(0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vgood = _mm_set1_epi32(GOOD_COUNTS);
+    const __m128i cone = _mm_set1_epi32(1);
+    const __m128i htwo = _mm_set1_epi32(2);
+
+    int ngood = 0;
+    int k = 0;
+    for (; k + 4 <= n; k += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (piz + k));
+        __m128i c = _mm_and_si128(_mm_cmpeq_epi8(v, vc), one);
+        __m128i h = _mm_and_si128(_mm_cmpeq_epi8(v, vh), one);
+        c = _mm_add_epi32(c, _mm_srli_epi32(c, 8));
+        c = _mm_and_si128(_mm_add_epi32(c, _mm_srli_epi32(c, 16)), low);
+        h = _mm_add_epi32(h, _mm_srli_epi32(h, 8));
+        h = _mm_and_si128(_mm_add_epi32(h, _mm_srli_epi32(h, 16)), low);
+
+        __m128i ok = _mm_and_si128(_mm_cmpeq_epi32(c, cone), _mm_cmpeq_epi32(h, htwo));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_and_si128(v, top), zero));
+        __m128i cnt = _mm_loadu_si128((const __m128i*) (counts + k));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi32(cnt, vgood));
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        for (int j = 0; j < 4; j++)
+            good[k + j] = (mask >> j) & 1;
+        ngood += __builtin_popcount(mask);
+    }
+
+    return ngood + kernel_scalar(piz + k, counts + k, good + k, n - k);
+}
+
+
+__attribute__((target("avx2")))
+int kernel_avx2(const unsigned* piz, const unsigned* counts, unsigned char* good, const int n)
+{
+    const __m256i vc = _mm256_set1_epi8('c');
+    const __m256i vh = _mm256_set1_epi8('h');
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i top = _mm256_set1_epi32(0xFF000000);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vgood = _mm256_set1_epi32(GOOD_COUNTS);
+    const __m256i cone = _mm256_set1_epi32(1);
+    const __m256i htwo = _mm256_set1_epi32(2);
+
+    int ngood = 0;
+    int k = 0;
+    for (; k + 8 <= n; k += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (piz + k));
+        __m256i c = _mm256_and_si256(_mm256_cmpeq_epi8(v, vc), one);
+        __m256i h = _mm256_and_si256(_mm256_cmpeq_epi8(v, vh), one);
+        c = _mm256_add_epi32(c, _mm256_srli_epi32(c, 8));
+        c = _mm256_and_si256(_mm256_add_epi32(c, _mm256_srli_epi32(c, 16)), low);
+        h = _mm256_add_epi32(h, _mm256_srli_epi32(h, 8));
+        h = _mm256_and_si256(_mm256_add_epi32(h, _mm256_srli_epi32(h, 16)), low);
+
+        __m256i ok = _mm256_and_si256(_mm256_cmpeq_epi32(c, cone), _mm256_cmpeq_epi32(h, htwo));
+        ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(_mm256_and_si256(v, top), zero));
+        __m256i cnt = _mm256_loadu_si256((const __m256i*) (counts + k));
+        ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(cnt, vgood));
+
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+        for (int j = 0; j < 8; j++)
+            good[k + j] = (mask >> j) & 1;
+        ngood += __builtin_popcount(mask);
+    }
+
+    return ngood + kernel_sse2(piz + k, counts + k, good + k, n - k);
+}
+#endif
+
+
+/*  Checked pizza leaves an empty cell for the next lap
+*/
+void pizza_recycle(struct monitor* mon, const int cell)
+{
+    assert(mon);
+
+    memset(PIZ(mon, cell), 0, sizeof(PIZ(mon, cell)));
+    PIZ_I(mon, cell) = 0;
+    PIZ_NODE(mon, cell) = 0;
+    for (int t = 0; t < recipe.ntypes; t++)
+        PIZ_HAVE(mon, cell, t) = 0;
+}
+
+
+/*  Ingredient is claimed under the lock, put outside of it
+    and the pizza is queued to checker by whoever puts the last one
+*/
+int pipe_put(struct monitor* mon, const int t)
+{
+    assert(mon);
+
+    int pos = 0;
+    int s = pipe_claim(mon, t, &pos);
+    if (s == -1)
+        return 0;
+
+    int cell = CELL(mon, mon->slots[s].pizza);
+    assemble();
+    PIZ(mon, cell)[pos] = recipe.sym[t];
+
+    int err = monitor_lock(mon);
+    error_check(err, "pipe put lock");
+
+    if (++mon->slots[s].placed == recipe.total)
+    {
+        while (mon->nmade - mon->ncheck == mon->nslots)
+        {
+            err = monitor_wait(mon, &mon->cond_queue);
+            error_check(err, "pipe queue wait");
+        }
+
+        mon->queue[mon->nmade % mon->nslots] = mon->slots[s].pizza;
+        mon->nmade++;
+        mon->slots[s].pizza = -1;
+
+        err = pthread_cond_signal(&mon->cond_check);
+        error_check(err, "pipe put signal check");
+
+        pipe_wake(mon, t, -1, 0);
+    }
+
+    err = monitor_unlock(mon);
+    error_check(err, "pipe put unlock");
 
-        mon->ncheck++;
+    return 1;
+}
+
+
+/*  Returns slot with a pizza that still needs type t or -1 when there is
+    none left, position of the ingredient in piz[] is stored to pos
+*/
+int pipe_claim(struct monitor* mon, const int t, int* pos)
+{
+    assert(mon && pos);
+
+    int err = monitor_lock(mon);
+    error_check(err, "pipe claim lock");
+
+    int s = -1;
+    int opened = 0;
+    while (1)
+    {
+        int free = -1;
+        int later = 0;
+        for (int i = 0; i < mon->nslots && s == -1; i++)
+        {
+            if (mon->slots[i].pizza == -1)
+                free = i;
+            else if (pipe_need(mon, i, t))
+                s = i;
+            else if (!recipe.any)
+            {
+                //fixed ordering may need t after other types
+                int node = PIZ_NODE(mon, CELL(mon, mon->slots[i].pizza));
+                later |= recipe.have[node][t] < recipe.count[t];
+            }
+        }
+
+        if (s != -1 || (mon->nopen == mon->npizzas && !later))
+            break;
+
+        //only types allowed first may start a pizza
+        int opener = free != -1 && NEXT(0, t) != -1 && mon->nopen < mon->npizzas;
+        if (opener && pipe_open(mon, free))
+        {
+            s = free;
+            opened = 1;
+            break;
+        }
+
+        //either slot or cell is taken
+        mon->ncell_wait += opener;
+        err = monitor_wait(mon, mon->cond_put + t);
+        error_check(err, "pipe claim wait");
+        mon->ncell_wait -= opener;
+    }
+
+    if (s != -1)
+    {
+        int cell = CELL(mon, mon->slots[s].pizza);
+        *pos = PIZ_I(mon, cell)++;
+        PIZ_HAVE(mon, cell, t)++;
+        PIZ_NODE(mon, cell) = NEXT(PIZ_NODE(mon, cell), t);
+        pipe_wake(mon, t, s, opened);
+    }
+
+    err = monitor_unlock(mon);
+    error_check(err, "pipe claim unlock");
+
+    return s;
+}
+
+
+int pipe_need(struct monitor* mon, const int s, const int t)
+{
+    assert(mon);
+
+    int cell = CELL(mon, mon->slots[s].pizza);
+    return NEXT(PIZ_NODE(mon, cell), t) != -1;
+}
+
+
+/*  Wakes workers who may have work after type t was claimed in slot s
+    or after a slot was freed, s is -1 then
+*/
+void pipe_wake(struct monitor* mon, const int t, const int s, const int opened)
+{
+    assert(mon);
+
+    int err = 0;
+    for (int k = 0; k < recipe.ntypes; k++)
+    {
+        //after the last pizza nobody waits for a slot anymore, all finish
+        if (mon->nopen == mon->npizzas)
+        {
+            err = pthread_cond_broadcast(mon->cond_put + k);
+            error_check(err, "pipe wake broadcast");
+            continue;
+        }
+
+        //one worker of any kind opens a freed slot, in any order
+        //others could take from an old pizza already
+        int wake = s == -1 ||
+                   (pipe_need(mon, s, k) && (opened || !recipe.any || k == t));
+        if (wake)
+        {
+            err = pthread_cond_signal(mon->cond_put + k);
+            error_check(err, "pipe wake signal");
+        }
+    }
+}
+
+
+/*  Puts the next pizza to slot s if its cell is checked already
+*/
+int pipe_open(struct monitor* mon, const int s)
+{
+    assert(mon);
+
+    int cell = CELL(mon, mon->nopen);
+    if (mon->busy[cell])
+        return 0;
+
+    mon->busy[cell] = 1;
+    mon->slots[s].pizza = mon->nopen++;
+    mon->slots[s].placed = 0;
+
+    return 1;
+}
+
+
+int pipe_check(struct monitor* mon)
+{
+    assert(mon);
+
+    int err = monitor_lock(mon);
+    error_check(err, "pipe check lock");
+
+    if (batch_free(mon) && mon->ncell_wait)
+    {
+        for (int t = 0; t < recipe.ntypes; t++)
+        {
+            err = pthread_cond_broadcast(mon->cond_put + t);
+            error_check(err, "pipe check broadcast");
+        }
+    }
+
+    while (!mon->all_check(mon) && mon->ncheck == mon->nmade)
+    {
+        err = monitor_wait(mon, &mon->cond_check);
+        error_check(err, "pipe check wait");
+    }
+
+    if (mon->ncheck < mon->nmade)
+    {
+        while (mon->ncheck < mon->nmade && mon->ntaken < BATCH)
+            mon->taken[mon->ntaken++] = mon->queue[mon->ncheck++ % mon->nslots];
+
+        err = pthread_cond_broadcast(&mon->cond_queue);
+        error_check(err, "pipe check broadcast queue");
     }
 
     int res = !mon->all_check(mon);
 
-    err = pthread_mutex_unlock(&mon->mutex);
-    error_check(err, "check unlock");
+    err = monitor_unlock(mon);
+    error_check(err, "pipe check unlock");
+
+    //nobody writes to a taken pizza
+    batch_verdict(mon, mon->taken, mon->ntaken);
 
     return res;
 }
 
 
-int is_ready(struct monitor* mon)
+/*  Every type of worker has a cursor to the first pizza which may still
+    need its ingredient, a pizza is started when checker frees its cell.
+    Claim moves the pizza word to the next trie node
+*/
+int lf_put(struct monitor* mon, const int t)
 {
     assert(mon);
-    return mon->pizzas[mon->nmade].i == 3;
+
+    long* cursor = &mon->cursors[t].n;
+    int idle = 0;
+
+    while (1)
+    {
+        long n = __atomic_load_n(cursor, __ATOMIC_SEQ_CST);
+        if (n >= mon->npizzas)
+            return 0;
+
+        int seq = __atomic_load_n(&mon->free_seq, __ATOMIC_SEQ_CST);
+        int cell = CELL(mon, n);
+        long word = __atomic_load_n(&PIZ_WORD(mon, cell), __ATOMIC_SEQ_CST);
+        if (word >> LAP_SHIFT != n / mon->depth)
+        {
+            if (++idle > SPIN)
+                futex_wait(&mon->free_seq, &mon->nsleep, seq);
+            continue;
+        }
+
+        int node = word & NODE_MASK;
+        if (recipe.have[node][t] == recipe.count[t])
+        {
+            //help the slow one to move cursor
+            __atomic_compare_exchange_n(cursor, &n, n + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        //fixed ordering wants another type first
+        int next = NEXT(node, t);
+        if (next == -1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        if (!__atomic_compare_exchange_n(&PIZ_WORD(mon, cell), &word, (word & ~(long) NODE_MASK) | next,
+                                         0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            continue;
+
+        long expected = n;
+        if (recipe.have[next][t] == recipe.count[t])
+            __atomic_compare_exchange_n(cursor, &expected, n + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+        assemble();
+        PIZ(mon, cell)[recipe.len[node]] = recipe.sym[t];
+
+        //ingredients put by others are visible to whoever puts the last one
+        word = __atomic_add_fetch(&PIZ_WORD(mon, cell), 1L << PLACED_SHIFT, __ATOMIC_ACQ_REL);
+        if (((word >> PLACED_SHIFT) & PLACED_MASK) == recipe.total)
+            lf_done(mon, n, word);
+
+        prof_done();
+        return 1;
+    }
 }
 
 
-int all_ready(struct monitor* mon)
+void lf_done(struct monitor* mon, const long n, const long word)
 {
     assert(mon);
-    return mon->nmade == mon->npizzas; 
+
+    if (!ring)
+        ring = mon->rings + __atomic_fetch_add(&mon->nrings, 1, __ATOMIC_RELAXED);
+
+    int cell = CELL(mon, n);
+    int node = word & NODE_MASK;
+    PIZ_NODE(mon, cell) = node;
+    PIZ_I(mon, cell) = recipe.len[node];
+    for (int t = 0; t < recipe.ntypes; t++)
+        PIZ_HAVE(mon, cell, t) = recipe.have[node][t];
+
+    ring->items[ring->tail % mon->depth] = n;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&mon->nmade, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&mon->made_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&mon->made_seq, &mon->check_sleep, 1);
 }
 
 
-int all_check(struct monitor* mon)
+/*  Takes all pizzas from rings of workers and gives their cells
+    to the next lap, sleeps if there were none
+*/
+int lf_check(struct monitor* mon)
 {
     assert(mon);
-    return mon->ncheck == mon->npizzas;
+
+    int seq = __atomic_load_n(&mon->made_seq, __ATOMIC_SEQ_CST);
+    int found = 0;
+
+    for (int i = 0; i < mon->nworkers && found < BATCH; i++)
+    {
+        struct ring* r = mon->rings + i;
+        long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (; r->head < tail && found < BATCH; r->head++)
+            mon->taken[found++] = r->items[r->head % mon->depth];
+    }
+
+    batch_verdict(mon, mon->taken, found);
+    for (int j = 0; j < found; j++)
+    {
+        long n = mon->taken[j];
+        int cell = CELL(mon, n);
+        pizza_recycle(mon, cell);
+        __atomic_store_n(&PIZ_WORD(mon, cell), (n / mon->depth + 1) << LAP_SHIFT,
+                         __ATOMIC_RELEASE);
+    }
+
+    if (found)
+    {
+        prof_done();
+        __atomic_add_fetch(&mon->ncheck, found, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&mon->free_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&mon->free_seq, &mon->nsleep, INT_MAX);
+    }
+    else if (!mon->all_check(mon))
+        futex_wait(&mon->made_seq, &mon->check_sleep, seq);
+
+    return !mon->all_check(mon);
+}
+
+
+/*  Sleeps while *addr is val, waiters let the other side skip the syscall
+*/
+void futex_wait(int* addr, int* waiters, int val)
+{
+#ifdef PROFILE
+    long start = get_ns();
+#endif
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+#ifdef PROFILE
+    if (prof)
+    {
+        prof->waits++;
+        prof->wait_ns += get_ns() - start;
+        prof->wasted += prof->woken;
+        prof->woken = 1;
+    }
+#endif
+}
+
+
+void futex_wake(int* addr, int* waiters, int n)
+{
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+
+/*  Lock and wait of the monitor, profiled ones count the time a thread
+    spends getting the mutex, holding it and blocked in waits. A wakeup
+    is wasted if the thread waits again without leaving the monitor
+*/
+int monitor_lock(struct monitor* mon)
+{
+#ifdef PROFILE
+    long start = get_ns();
+    int err = pthread_mutex_lock(&mon->mutex);
+    if (prof)
+    {
+        prof->since = get_ns();
+        prof->locks++;
+        prof->lock_ns += prof->since - start;
+    }
+    return err;
+#else
+    return pthread_mutex_lock(&mon->mutex);
+#endif
+}
+
+
+int monitor_unlock(struct monitor* mon)
+{
+#ifdef PROFILE
+    if (prof)
+        prof->hold_ns += get_ns() - prof->since;
+    prof_done();
+#endif
+    return pthread_mutex_unlock(&mon->mutex);
+}
+
+
+int monitor_wait(struct monitor* mon, pthread_cond_t* cond)
+{
+#ifdef PROFILE
+    long start = get_ns();
+    if (prof)
+        prof->hold_ns += start - prof->since;
+    int err = pthread_cond_wait(cond, &mon->mutex);
+    if (prof)
+    {
+        prof->since = get_ns();
+        prof->waits++;
+        prof->wait_ns += prof->since - start;
+        prof->wasted += prof->woken;
+        prof->woken = 1;
+    }
+    return err;
+#else
+    return pthread_cond_wait(cond, &mon->mutex);
+#endif
+}
+
+
+/*  Counters of the calling thread, index tells workers of a type apart
+*/
+void prof_start(const char* name, const int index)
+{
+#ifdef PROFILE
+    int i = __atomic_fetch_add(&nprofs, 1, __ATOMIC_RELAXED);
+    if (i >= PROF_MAX)
+        return;
+
+    prof = profs + i;
+    snprintf(prof->name, sizeof(prof->name), "%s %d", name, index);
+#else
+    (void) name;
+    (void) index;
+#endif
+}
+
+
+/*  Thread did something after its last wakeup
+*/
+void prof_done()
+{
+#ifdef PROFILE
+    if (prof)
+        prof->woken = 0;
+#endif
+}
+
+
+#ifdef PROFILE
+void prof_report()
+{
+    int n = nprofs < PROF_MAX ? nprofs : PROF_MAX;
+#ifdef PROFILE_JSON
+    fprintf(stderr, "[\n");
+    for (int i = 0; i < n; i++)
+    {
+        struct prof* p = profs + i;
+        fprintf(stderr, "  {\"thread\": \"%s\", \"locks\": %ld, \"lock_ns\": %ld, "
+                "\"hold_ns\": %ld, \"waits\": %ld, \"wait_ns\": %ld, \"wasted\": %ld}%s\n",
+                p->name, p->locks, p->lock_ns, p->hold_ns, p->waits, p->wait_ns,
+                p->wasted, i + 1 < n ? "," : "");
+    }
+    fprintf(stderr, "]\n");
+#else
+    fprintf(stderr, "%-20s %10s %10s %10s %10s %10s %10s\n", "thread",
+            "locks", "lock ms", "hold ms", "wakeups", "wait ms", "wasted");
+    for (int i = 0; i < n; i++)
+    {
+        struct prof* p = profs + i;
+        fprintf(stderr, "%-20s %10ld %10.3lf %10.3lf %10ld %10.3lf %10ld\n",
+                p->name, p->locks, p->lock_ns / 1e6, p->hold_ns / 1e6,
+                p->waits, p->wait_ns / 1e6, p->wasted);
+    }
+#endif
+}
+#endif
+
+
+/*  Zeroed memory starting at a cache line
+*/
+void* alloc_lines(size_t size)
+{
+    size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    void* mem = aligned_alloc(CACHE_LINE, size);
+    assert(mem);
+    memset(mem, 0, size);
+
+    return mem;
+}
+
+
+void perf_start()
+{
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.inherit = 1;
+        //software events happen in kernel only
+        attr.exclude_kernel = counters[i].type != PERF_TYPE_SOFTWARE;
+        attr.exclude_hv = 1;
+        attr.disabled = 1;
+
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        counters[i].fd = fd;
+        if (fd != -1)
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+
+void perf_report(const long npizzas)
+{
+    fprintf(stderr, "%-20s %16s %12s\n", "counter", "total", "per pizza");
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    {
+        long long val = 0;
+        int fd = counters[i].fd;
+        if (fd == -1 || read(fd, &val, sizeof(val)) != sizeof(val))
+            fprintf(stderr, "%-20s %16s\n", counters[i].name, "not supported");
+        else
+            fprintf(stderr, "%-20s %16lld %12.3lf\n",
+                    counters[i].name, val, (double) val / npizzas);
+        if (fd != -1)
+            close(fd);
+    }
+}
+
+
+/*  Busy work of putting one ingredient
+*/
+void assemble()
+{
+    for (volatile long i = 0; i < work; i++);
 }
 
+
+int parse_arg(const char* arg, const char* name)
+{
+    char* end = NULL;
+    errno = 0;
+    long val = strtol(arg, &end, 0);
+    if (errno || *end || val <= 0 || val > 1000000000)
+    {
+        printf("%s: invalid %s: %s\n", progname, name, arg);
+        return 0;
+    }
+
+    return (int) val;
+}
+
+
+double get_time()
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
+}
+
+
+long get_ns()
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
@@ -1,175 +1,1677 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 
+#define report(...)                 \
+do{                                 \
+    if (!quiet)                     \
+        printf(__VA_ARGS__);        \
+} while(0)
+
+
+enum
+{
+    THREAD_STACK = 64 * 1024,
+    MAILBOX_CAP = 4,
+    BATCH_MAX = 64,
+    BACKOFF_MAX = 10000     //us
+};
+
 enum MSG_TYPE
 {
     READY = 1,
-    START = 10,  //type of message "start to runner i" = START + i
+    START = 10,  //type of message "start to runner i" = START + i,
+                 //"subtree of runner i is ready" = START + ntotal + i
     FINISH = 2
 };
 
+enum RACE_MODE
+{
+    MODE_PROCESS = 0,
+    MODE_THREADS,
+    MODE_COMPARE
+};
+
+enum RUNNER_STATE
+{
+    RS_ARRIVED = 0,
+    RS_READY,
+    RS_DONE
+};
+
+enum BARRIER_MODE
+{
+    BARRIER_LINEAR = 0,
+    BARRIER_TREE,
+    BARRIER_SHM
+};
+
+enum PIN_MODE
+{
+    PIN_NONE = 0,
+    PIN_COMPACT,
+    PIN_SCATTER,
+    PIN_NUMA,
+    PIN_LIST
+};
+
+enum HOP_CLASS
+{
+    HOP_SAME_CORE = 0,
+    HOP_CROSS_CORE,
+    HOP_CROSS_SOCKET,
+    HOP_NCLASS
+};
+
 struct mymsgbuf
 {
-    long type;
-    int num;
+    long   type;
+    int    num;
+    int    count;   //number of batons in message
+    double tm;      //time of sending, used to measure hop latency
+    int    baton[BATCH_MAX];
+};
+
+/*  Bounded queue of messages of one type, used instead of
+    message queue when judge and runners are threads
+*/
+struct mailbox
+{
+    struct mymsgbuf* msgs;
+    long             cap;
+    long             head;
+    long             count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond_empty;
+    pthread_cond_t  cond_full;
+};
+
+/*  Transport of the baton between judge and runners:
+    System V message queue or in-process mailboxes
+*/
+struct channel
+{
+    int             msgid;
+    struct mailbox* boxes;
+    long            nboxes;
+    long            window;     //messages that can be in flight without blocking
+
+    int  (*send)(struct channel*, const struct mymsgbuf*, int flags);
+    int  (*recv)(struct channel*, struct mymsgbuf*, long type, int flags);
+    void (*clear)(struct channel*);
+};
+
+struct cpuinfo
+{
+    int cpu;
+    int core;
+    int package;
+    int node;
+};
+
+/*  filled by runner i in shared memory and read by judge
+    after the race
+*/
+struct runner_stat
+{
+    int    cpu;
+    int    core;
+    int    package;
+    int    node;
+    double hop;     //latency of the baton hand-off to this runner
+    long   rss;     //resident memory of runner process, kB
+    double ready_tm;    //arrival at the start barrier
+
+    enum RUNNER_STATE state;
+    long passed;        //batons passed to the next runner
+    long given;         //batons sent to this runner
+    double first_tm;    //time the first batons were passed, checked by judge
+    long children_ready;
+};
+
+struct race_stat
+{
+    double spawn;   //time to create all judge and runners
+    double startup; //time from the first spawn to START
+    double total;   //time from START to FINISH
+    double hop;     //average hand-off latency
+    double msg_rate;
+    long   progress;    //messages passed by runners, used for timeouts
+    double start_tm;
+    double barrier;     //time from the last arrival at the barrier to START
+
+    int    bar_count;   //shared memory barrier
+    int    bar_sense;
+    long   rss;     //total resident memory, kB
+    long   judge_rss;
 };
 
-int msgid = 0;
-long nrunner = 0;
+long nrunner = 0;   //runners in one lane
+long nlane = 1;
+long ntotal = 0;
+long nbaton = 1;    //batons relayed by every lane
+long batch = 1;     //batons in one message
+long leg_usec = 1000000;
+int  quiet = 0;
+int  supervise = 0;
+long timeout = 10;  //seconds without progress before judge gives up
+long crash = -1;    //runner killed in the middle of its leg, for testing
+
+int   queueId = -1;
+pid_t queueOwner = 0;
 
-void runner(int i);
-void judge();
+enum RACE_MODE    race_mode = MODE_PROCESS;
+enum BARRIER_MODE barrier_mode = BARRIER_LINEAR;
+enum PIN_MODE   pin_mode = PIN_NONE;
+struct cpuinfo* cpus = NULL;
+int             ncpu = 0;
+int*            pin_list = NULL;
+int             npin_list = 0;
+
+struct channel*     chan = NULL;
+struct runner_stat* stats = NULL;
+struct race_stat*   race = NULL;
+double              spawnTm = 0;
+
+int runner(int i);
+int judge();
 double getCurrentTime();
 
+void raceRun(enum RACE_MODE mode);
+void raceProcesses();
+void raceThreads();
+void* judgeThread(void* arg);
+void* runnerThread(void* arg);
+long  selfRss();
+void printSummary(const char* name, const struct race_stat* st);
+int  raceSupervised(pid_t* pids, const sigset_t* mask);
+void proxyForward(long r, struct mymsgbuf* msg, double deathTm, double* recovery);
+void proxyLost(long r, long seq, double deathTm, double* recovery);
+int  laneOrdered(long lane);
+int  recvTimed(struct mymsgbuf* msg, long type);
+void removeQueue();
+
+void barrierArrive(int r);
+void barrierWait();
+int  barrierProxy(long r);
+long treeType(long parent);
+void shmArrive();
+int  shmWait();
+
+struct channel* msgChannelInit();
+int  msgSend(struct channel*, const struct mymsgbuf*, int flags);
+int  msgRecv(struct channel*, struct mymsgbuf*, long type, int flags);
+void msgClear(struct channel*);
+
+struct channel* boxChannelInit();
+struct mailbox* boxOf(struct channel*, long type);
+int  boxSend(struct channel*, const struct mymsgbuf*, int flags);
+int  boxRecv(struct channel*, struct mymsgbuf*, long type, int flags);
+void boxClear(struct channel*);
+
+void parseArgs(int argc, char* argv[]);
+int  parseCpuList(const char* str, int** list);
+void topologyInit();
+int  readSysInt(const char* fmt, int cpu);
+int  cpuNode(int cpu);
+int  cmpCompact(const void* a, const void* b);
+void orderScatter();
+int  placeRunner(int i);
+void fillPlacement(struct runner_stat* st);
+enum HOP_CLASS hopClass(const struct runner_stat* from, const struct runner_stat* to);
+void printPlacement();
+
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    parseArgs(argc, argv);
+
+    if (pin_mode != PIN_NONE)
+        topologyInit();
+
+    stats = (struct runner_stat*) mmap(NULL, ntotal * sizeof(struct runner_stat),
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    race = (struct race_stat*) mmap(NULL, sizeof(struct race_stat) * 2,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED || race == MAP_FAILED)
     {
-        printf("Wrong number of arguments: %d, expected: 1\n", argc - 1);
-        return 0;
+        perror("Cant map runner stats");
+        exit(-1);
+    }
+
+    if (race_mode == MODE_COMPARE)
+    {
+        raceRun(MODE_PROCESS);
+        race++;
+        raceRun(MODE_THREADS);
+        race--;
+
+        printf("\n%-22s %14s %14s\n", "", "processes", "threads");
+        printf("%-22s %14.2lf %14.2lf\n", "spawn, ms", race[0].spawn * 1e3, race[1].spawn * 1e3);
+        printf("%-22s %14.2lf %14.2lf\n", "startup, ms", race[0].startup * 1e3, race[1].startup * 1e3);
+        printf("%-22s %14.2lf %14.2lf\n", "barrier, ms", race[0].barrier * 1e3, race[1].barrier * 1e3);
+        printf("%-22s %14.2lf %14.2lf\n", "race, ms", race[0].total * 1e3, race[1].total * 1e3);
+        printf("%-22s %14.2lf %14.2lf\n", "avg hop, us", race[0].hop * 1e6, race[1].hop * 1e6);
+        printf("%-22s %14.0lf %14.0lf\n", "messages/s", race[0].msg_rate, race[1].msg_rate);
+        printf("%-22s %14.2lf %14.2lf\n", "RSS (PSS), MB", race[0].rss / 1024.0, race[1].rss / 1024.0);
+    }
+    else
+    {
+        raceRun(race_mode);
+        printSummary(race_mode == MODE_THREADS ? "threads" : "processes", race);
+    }
+
+    munmap(stats, ntotal * sizeof(struct runner_stat));
+    munmap(race, sizeof(struct race_stat) * 2);
+    free(cpus);
+    free(pin_list);
+
+    return 0;
+}
+
+
+void raceRun(enum RACE_MODE mode)
+{
+    memset(stats, 0, ntotal * sizeof(struct runner_stat));
+    memset(race, 0, sizeof(struct race_stat));
+
+    if (mode == MODE_THREADS)
+        raceThreads();
+    else
+        raceProcesses();
+
+    double hop = 0;
+    double lastReady = 0;
+    for (int i = 0; i < ntotal; i++)
+    {
+        hop += stats[i].hop;
+        if (stats[i].ready_tm > lastReady)
+            lastReady = stats[i].ready_tm;
+    }
+    race->hop = hop / ntotal;
+    race->barrier = race->start_tm - lastReady;
+}
+
+
+void raceProcesses()
+{
+    chan = msgChannelInit();
+
+    sigset_t mask;
+    sigset_t oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (supervise)
+        sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    pid_t* pids = (pid_t*) calloc(ntotal + 1, sizeof(pid_t));
+
+    spawnTm = getCurrentTime();
+
+    for (int i = 0; i < ntotal + 1; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] < 0)
+        {
+            perror("Cant fork");
+            exit(-1);
+        }
+
+        if (pids[i] == 0)
+        {
+            if (supervise)
+                sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            exit(i == 0 ? judge() : runner(i - 1));
+        }
+    }
+
+    race->spawn = getCurrentTime() - spawnTm;
+
+    int res = 0;
+    if (supervise)
+    {
+        res = raceSupervised(pids, &mask);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    }
+    else
+    {
+        for (int i = 0; i < ntotal + 1; i++)
+            wait(NULL);
+    }
+    free(pids);
+
+    chan->clear(chan);
+    if (res < 0)
+        exit(EXIT_FAILURE);
+
+    race->rss = selfRss() + race->judge_rss;
+    for (int i = 0; i < ntotal; i++)
+        race->rss += stats[i].rss;
+}
+
+
+void raceThreads()
+{
+    chan = boxChannelInit();
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+
+    pthread_t* thrid = (pthread_t*) calloc(ntotal + 1, sizeof(pthread_t));
+    int err = 0;
+
+    spawnTm = getCurrentTime();
+
+    err = pthread_create(thrid, &attr, judgeThread, NULL);
+    if (err)
+    {
+        fprintf(stderr, "Cant create judge: %s\n", strerror(err));
+        exit(-1);
+    }
+
+    for (long i = 0; i < ntotal; i++)
+    {
+        err = pthread_create(thrid + i + 1, &attr, runnerThread, (void*) i);
+        if (err)
+        {
+            fprintf(stderr, "Cant create runner %ld: %s\n", i, strerror(err));
+            exit(-1);
+        }
     }
 
-    nrunner = strtol(argv[1], 0 , 0);
+    race->spawn = getCurrentTime() - spawnTm;
+
+    for (int i = 0; i < ntotal + 1; i++)
+        pthread_join(thrid[i], NULL);
+
+    chan->clear(chan);
+    pthread_attr_destroy(&attr);
+    free(thrid);
+
+    race->rss = selfRss();
+}
+
+
+void* judgeThread(void* arg)
+{
+    (void) arg;
+    judge();
+    return NULL;
+}
+
+
+void* runnerThread(void* arg)
+{
+    runner((int) (long) arg);
+    return NULL;
+}
+
+
+/*  Proportional resident memory of calling process, kB
+    Shared pages are split between processes, so the sum over
+    judge and runners is comparable with a single process
+*/
+long selfRss()
+{
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    long rss = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "Pss: %ld", &rss) == 1)
+            break;
+    }
+    fclose(f);
+
+    return rss;
+}
+
+
+void printSummary(const char* name, const struct race_stat* st)
+{
+    printf("Race (%s): spawn %.2lf ms, startup %.2lf ms, barrier %.2lf ms, race %.2lf ms, "
+           "avg hop %.2lf us, %.0lf messages/s, RSS (PSS) %.2lf MB\n",
+           name, st->spawn * 1e3, st->startup * 1e3, st->barrier * 1e3, st->total * 1e3,
+           st->hop * 1e6, st->msg_rate, st->rss / 1024.0);
+}
+
+
+void parseArgs(int argc, char* argv[])
+{
+    struct option longopts[] = {
+        {"pin", required_argument, NULL, 'p'},
+        {"leg", required_argument, NULL, 'l'},
+        {"threads", no_argument, NULL, 't'},
+        {"compare", no_argument, NULL, 'c'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"lanes", required_argument, NULL, 'L'},
+        {"batch", required_argument, NULL, 'b'},
+        {"batons", required_argument, NULL, 'n'},
+        {"supervise", no_argument, NULL, 's'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"crash", required_argument, NULL, 'C'},
+        {"barrier", required_argument, NULL, 'B'},
+        {0, 0, 0, 0}
+    };
+
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, "p:l:tcqL:b:n:sT:C:B:", longopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'p':
+                if (!strcmp(optarg, "compact"))
+                    pin_mode = PIN_COMPACT;
+                else if (!strcmp(optarg, "scatter"))
+                    pin_mode = PIN_SCATTER;
+                else if (!strcmp(optarg, "numa"))
+                    pin_mode = PIN_NUMA;
+                else if ((npin_list = parseCpuList(optarg, &pin_list)) > 0)
+                    pin_mode = PIN_LIST;
+                else
+                {
+                    printf("Wrong pin mode: %s, expected: compact, scatter, numa "
+                           "or list of cpus (e.g. 0,2,4-7)\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'l':
+                leg_usec = strtol(optarg, 0, 0);
+                if (leg_usec < 0)
+                {
+                    printf("Leg time must be non-negative\n");
+                    exit(0);
+                }
+                break;
+            case 't':
+                race_mode = MODE_THREADS;
+                break;
+            case 'c':
+                race_mode = MODE_COMPARE;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'L':
+                nlane = strtol(optarg, 0, 0);
+                if (nlane <= 0)
+                {
+                    printf("Number of lanes must be positive\n");
+                    exit(0);
+                }
+                break;
+            case 'b':
+                batch = strtol(optarg, 0, 0);
+                if (batch <= 0 || batch > BATCH_MAX)
+                {
+                    printf("Batch must be in range from 1 to %d\n", BATCH_MAX);
+                    exit(0);
+                }
+                break;
+            case 's':
+                supervise = 1;
+                break;
+            case 'T':
+                timeout = strtol(optarg, 0, 0);
+                if (timeout <= 0)
+                {
+                    printf("Timeout must be positive\n");
+                    exit(0);
+                }
+                break;
+            case 'B':
+                if (!strcmp(optarg, "linear"))
+                    barrier_mode = BARRIER_LINEAR;
+                else if (!strcmp(optarg, "tree"))
+                    barrier_mode = BARRIER_TREE;
+                else if (!strcmp(optarg, "shm"))
+                    barrier_mode = BARRIER_SHM;
+                else
+                {
+                    printf("Wrong barrier: %s, expected: linear, tree or shm\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'C':
+                crash = strtol(optarg, 0, 0);
+                break;
+            case 'n':
+                nbaton = strtol(optarg, 0, 0);
+                if (nbaton <= 0 || nbaton > INT_MAX)
+                {
+                    printf("Number of batons must be positive\n");
+                    exit(0);
+                }
+                break;
+            default:
+                exit(0);
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        printf("Wrong number of arguments: %d, expected: 1\n", argc - optind);
+        exit(0);
+    }
+
+    nrunner = strtol(argv[optind], 0 , 0);
     if (nrunner <= 0)
     {
         printf("Number of runners must de positive\n");
-        return 0;
+        exit(0);
     }
+    ntotal = nrunner * nlane;
 
-    if ((msgid = msgget(IPC_PRIVATE, 0700)) == -1)
+    if (supervise && race_mode != MODE_PROCESS)
     {
-        perror("Cant get msgid");
+        printf("Supervisor mode needs runners to be processes\n");
+        exit(0);
+    }
+
+    //without supervisor nobody passes the baton of the crashed runner
+    if (crash >= 0 && !supervise)
+    {
+        printf("Crash needs supervisor mode\n");
+        exit(0);
+    }
+}
+
+
+int judge()
+{
+    report("Judge: arrived at the stadium\n");
+
+    barrierWait();
+
+    report("Judge: START!\n");
+
+    double startRaceTm = getCurrentTime();
+    race->startup = startRaceTm - spawnTm;
+    race->start_tm = startRaceTm;
+
+    long*   received = (long*) calloc(nlane, sizeof(long));
+    double* laneTm = (double*) calloc(nlane, sizeof(double));
+    long    nfinished = 0;
+    long    inflight = 0;
+    long    seq = 0;
+    long    lane = 0;
+
+    /*  batons are sent to lanes round-robin without blocking, so that
+        judge never waits for free space in the queue while it is
+        filled with messages "Finish" which only judge can take.
+        Number of messages in flight is limited by the channel window:
+        otherwise every runner may block on sending into the full queue
+    */
+    while (nfinished < nlane)
+    {
+        if (seq < nbaton && inflight < chan->window)
+        {
+            struct mymsgbuf start = {(long) START + lane * nrunner, 0, 0, getCurrentTime(), {0}};
+            start.count = (nbaton - seq < batch) ? nbaton - seq : batch;
+            for (int j = 0; j < start.count; j++)
+                start.baton[j] = seq + j;
+
+            if (chan->send(chan, &start, IPC_NOWAIT) == 0)
+            {
+                __atomic_store_n(&stats[lane * nrunner].given, seq + start.count, __ATOMIC_RELEASE);
+                inflight++;
+                if (++lane == nlane)
+                {
+                    lane = 0;
+                    seq += batch;
+                }
+                continue;
+            }
+
+            if (errno != EAGAIN)
+            {
+                fprintf(stderr, "Judge can't send message \"Start\": %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        struct mymsgbuf finish;
+        if (recvTimed(&finish, (long) FINISH) < 0)
+        {
+            fprintf(stderr, "Judge can't receive message \"Finish\": %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        long fl = finish.num / nrunner;
+        if (supervise && finish.num % nrunner == nrunner - 1 && finish.baton[0] < received[fl])
+        {
+            report("Judge: duplicate batons from lane %ld\n", fl);
+            continue;
+        }
+        inflight--;
+
+        if (finish.num % nrunner != nrunner - 1 || finish.baton[0] != received[fl])
+        {
+            fprintf(stderr, "Violation of the order runners\n");
+            exit(EXIT_FAILURE);
+        }
+
+        received[fl] += finish.count;
+        if (received[fl] == nbaton)
+        {
+            laneTm[fl] = getCurrentTime() - startRaceTm;
+            nfinished++;
+
+            if (!laneOrdered(fl))
+            {
+                fprintf(stderr, "Violation of the order runners in lane %ld\n", fl);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    double finishRaceTm = getCurrentTime();
+    race->total = finishRaceTm - startRaceTm;
+    report("Judge: race finish, total time: %.2lf\n", finishRaceTm - startRaceTm);
+
+    //every message passes nrunner + 1 hops: judge, runners, judge
+    long nmsg = nlane * ((nbaton + batch - 1) / batch) * (nrunner + 1);
+    race->msg_rate = nmsg / race->total;
+
+    if (nlane > 1 || nbaton > 1)
+    {
+        double sum = 0;
+        double sum2 = 0;
+        for (long l = 0; l < nlane; l++)
+        {
+            double rate = nbaton / laneTm[l];
+            sum += rate;
+            sum2 += rate * rate;
+            printf("Judge: lane %ld: %.2lf ms, %.0lf batons/s\n", l, laneTm[l] * 1e3, rate);
+        }
+
+        printf("Judge: %ld lanes, batch %ld: %ld messages, %.0lf messages/s, "
+               "%.0lf batons/s, fairness %.3lf\n",
+               nlane, batch, nmsg, race->msg_rate, nbaton * nlane / race->total,
+               sum * sum / (nlane * sum2));
+    }
+
+    free(received);
+    free(laneTm);
+
+    printPlacement();
+
+    race->judge_rss = selfRss();
+
+    return EXIT_SUCCESS;
+}
+
+/*  The first batons of the lane are passed by every runner,
+    in order, before they come to judge
+*/
+int laneOrdered(long lane)
+{
+    double prev = 0;
+    for (long r = lane * nrunner; r < (lane + 1) * nrunner; r++)
+    {
+        if (stats[r].first_tm == 0 || stats[r].first_tm < prev)
+            return 0;
+        prev = stats[r].first_tm;
+    }
+
+    return 1;
+}
+
+
+/*  runner r is runner r % nrunner of lane r / nrunner
+*/
+int runner(int r)
+{
+    int cpu = placeRunner(r);
+    if (cpu >= 0)
+        report("Runner %d: arrived at the stadium, pinned to cpu %d\n", r, cpu);
+    else
+        report("Runner %d: arrived at the stadium\n", r);
+
+    barrierArrive(r);
+    stats[r].state = RS_READY;
+
+    int last = (r % nrunner == nrunner - 1);
+    for (long passed = 0; passed < nbaton; )
+    {
+        struct mymsgbuf start;
+        if (chan->recv(chan, &start, (long) START + r, 0) < 0)
+        {
+            fprintf(stderr, "Runner %d can't receive message \"Start\": %s\n", r, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (start.baton[0] < passed)
+        {
+            report("Runner %d: duplicate batons from %d\n", r, start.baton[0]);
+            continue;
+        }
+
+        if (passed == 0)
+        {
+            stats[r].hop = getCurrentTime() - start.tm;
+            fillPlacement(stats + r);
+            report("Runner %d: start\n", r);
+
+            if (leg_usec > 0)
+            {
+                unsigned int seed = time(NULL) + getpid() + r;
+                usleep((rand_r(&seed) % 100) * (leg_usec / 100));
+            }
+
+            if (r == crash)
+                abort();
+        }
+        passed += start.count;
+
+        start.type = last ? FINISH : START + r + 1;
+        start.num = r;
+        start.tm = getCurrentTime();
+        if (start.baton[0] == 0)
+            stats[r].first_tm = start.tm;
+        if (chan->send(chan, &start, 0) < 0)
+        {
+            if (last)
+                fprintf(stderr, "Runner %d can't send message \"Finish\": %s\n", r, strerror(errno));
+            else
+                fprintf(stderr, "Runner %d can't send message \"Start %d\": %s\n", r, r + 1, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        stats[r].passed = passed;
+        if (!last)
+            __atomic_store_n(&stats[r + 1].given, passed, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&race->progress, 1, __ATOMIC_RELAXED);
+    }
+    stats[r].state = RS_DONE;
+
+    report("Runner %d: finish\n", r);
+
+    if (race_mode != MODE_THREADS)
+        stats[r].rss = selfRss();
+
+    return EXIT_SUCCESS;
+}
+
+double getCurrentTime()
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (double) (ts.tv_nsec) / 1000000000;
+}
+
+
+/*  Supervisor: reaps judge and runners through signalfd, forwards
+    batons on behalf of dead runners, so their legs are skipped, and
+    stops the race if judge dies
+    Returns -1 if the race was stopped
+*/
+int raceSupervised(pid_t* pids, const sigset_t* mask)
+{
+    int sfd = signalfd(-1, mask, SFD_CLOEXEC);
+    if (sfd < 0)
+    {
+        perror("Cant create signalfd");
         exit(-1);
     }
 
-    pid_t pid = fork();
-    if (pid == 0)
-        judge();
+    char*   dead = (char*) calloc(ntotal, 1);
+    double* deathTm = (double*) calloc(ntotal, sizeof(double));
+    double* recovery = (double*) calloc(ntotal, sizeof(double));
+    long    alive = ntotal + 1;
+    long    nproxy = 0;
+    int     stopped = 0;
 
-    for (int i = 0; i < nrunner; i++)
+    while (alive > 0)
     {
-        pid = fork();
-        if (pid == 0)
-            runner(i);
+        struct pollfd pfd = {sfd, POLLIN, 0};
+        int res = poll(&pfd, 1, nproxy ? 1 : -1);
+        if (res < 0 && errno != EINTR)
+        {
+            perror("Supervisor can't poll");
+            exit(-1);
+        }
+
+        if (res > 0)
+        {
+            struct signalfd_siginfo si;
+            if (read(sfd, &si, sizeof(si)) == sizeof(si) && si.ssi_signo != SIGCHLD)
+            {
+                fprintf(stderr, "Supervisor: got signal %d, stop the race\n", si.ssi_signo);
+                stopped = 1;
+                for (long i = 0; i < ntotal + 1; i++)
+                    kill(pids[i], SIGKILL);
+            }
+        }
+
+        pid_t pid = 0;
+        int status = 0;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            alive--;
+            if (stopped || (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS))
+                continue;
+
+            long idx = 0;
+            while (idx < ntotal + 1 && pids[idx] != pid)
+                idx++;
+
+            if (idx == 0)
+            {
+                fprintf(stderr, "Supervisor: judge failed, stop the race\n");
+                stopped = 1;
+                for (long i = 1; i < ntotal + 1; i++)
+                    kill(pids[i], SIGKILL);
+                continue;
+            }
+
+            if (idx > ntotal || dead[idx - 1])
+                continue;
+
+            long r = idx - 1;
+            dead[r] = 1;
+            deathTm[r] = getCurrentTime();
+            recovery[r] = -1;
+            nproxy++;
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "Supervisor: runner %ld killed by signal %d, skip its leg\n",
+                        r, WTERMSIG(status));
+            else
+                fprintf(stderr, "Supervisor: runner %ld exited with %d, skip its leg\n",
+                        r, WEXITSTATUS(status));
+        }
+
+        for (long r = 0; r < ntotal; r++)
+        {
+            if (dead[r] != 1)
+                continue;
+
+            if (stats[r].state == RS_ARRIVED && barrierProxy(r))
+                stats[r].state = RS_READY;
+
+            //batons sent to runner before this moment are either waiting
+            //in its queue or were taken by it and are lost
+            long given = __atomic_load_n(&stats[r].given, __ATOMIC_ACQUIRE);
+
+            //lost batons were taken before those still waiting
+            struct mymsgbuf msg;
+            while (stats[r].passed < nbaton &&
+                   chan->recv(chan, &msg, START + r, IPC_NOWAIT) >= 0)
+            {
+                proxyLost(r, msg.baton[0], deathTm[r], recovery);
+                proxyForward(r, &msg, deathTm[r], recovery);
+            }
+            proxyLost(r, given, deathTm[r], recovery);
+
+            if (stats[r].state != RS_ARRIVED && stats[r].passed >= nbaton)
+            {
+                dead[r] = 2;
+                nproxy--;
+            }
+        }
+    }
+
+    for (long r = 0; r < ntotal; r++)
+    {
+        if (dead[r] && recovery[r] >= 0)
+            printf("Supervisor: runner %ld leg skipped, recovery latency %.2lf us\n",
+                   r, recovery[r] * 1e6);
+        else if (dead[r])
+            printf("Supervisor: runner %ld leg was not recovered\n", r);
+    }
+
+    close(sfd);
+    free(dead);
+    free(deathTm);
+    free(recovery);
+
+    return stopped ? -1 : 0;
+}
+
+
+/*  Pass message of dead runner r to the next one, unless
+    it was passed already
+*/
+void proxyForward(long r, struct mymsgbuf* msg, double deathTm, double* recovery)
+{
+    if (msg->baton[0] < stats[r].passed)
+        return;
+
+    double arrivalTm = (msg->tm > deathTm) ? msg->tm : deathTm;
+
+    int last = (r % nrunner == nrunner - 1);
+    stats[r].passed += msg->count;
+    msg->type = last ? FINISH : START + r + 1;
+    msg->num = r;
+    msg->tm = getCurrentTime();
+    if (msg->baton[0] == 0 && stats[r].first_tm == 0)
+        stats[r].first_tm = msg->tm;
+    if (chan->send(chan, msg, 0) < 0)
+    {
+        fprintf(stderr, "Supervisor can't pass baton of runner %ld: %s\n", r, strerror(errno));
+        return;
     }
+    if (!last)
+        __atomic_store_n(&stats[r + 1].given, stats[r].passed, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&race->progress, 1, __ATOMIC_RELAXED);
+
+    if (recovery[r] < 0)
+        recovery[r] = msg->tm - arrivalTm;
+}
 
-    for (int i = 0; i < nrunner + 1; i++)
-        wait(NULL);
 
-    if (msgctl(msgid, IPC_RMID, NULL) < 0)
+/*  Send again batons before seq taken by dead runner r
+*/
+void proxyLost(long r, long seq, double deathTm, double* recovery)
+{
+    while (stats[r].passed < seq)
     {
-        perror("Cant remove msg");
+        long first = stats[r].passed;
+        struct mymsgbuf lost = {START + r, 0, 0, deathTm, {0}};
+        lost.count = (seq - first < batch) ? seq - first : batch;
+        for (int j = 0; j < lost.count; j++)
+            lost.baton[j] = first + j;
+        proxyForward(r, &lost, deathTm, recovery);
+    }
+}
+
+
+/*  Receive message with timeout in supervisor mode: poll with backoff
+    and fail if there is no progress in the race for timeout seconds
+*/
+int recvTimed(struct mymsgbuf* msg, long type)
+{
+    if (!supervise)
+        return chan->recv(chan, msg, type, 0);
+
+    long backoff = 1;
+    long progress = __atomic_load_n(&race->progress, __ATOMIC_RELAXED);
+    double deadline = getCurrentTime() + timeout;
+
+    while (chan->recv(chan, msg, type, IPC_NOWAIT) < 0)
+    {
+        if (errno != ENOMSG)
+            return -1;
+
+        long cur = __atomic_load_n(&race->progress, __ATOMIC_RELAXED);
+        if (cur != progress)
+        {
+            progress = cur;
+            deadline = getCurrentTime() + timeout;
+        }
+        else if (getCurrentTime() > deadline)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        usleep(backoff);
+        if (backoff < BACKOFF_MAX)
+            backoff *= 2;
     }
 
     return 0;
 }
 
 
-void judge()
+void removeQueue()
+{
+    if (queueOwner == getpid() && queueId >= 0)
+        msgctl(queueId, IPC_RMID, NULL);
+}
+
+
+/*  Runner r reports that it is ready to start
+    tree: runner waits for its children 2r + 1 and 2r + 2, then reports
+          to its parent, root reports to judge
+    shm:  runner arrives at sense-reversing barrier in shared memory,
+          the last one flips the sense and wakes judge
+*/
+void barrierArrive(int r)
+{
+    stats[r].ready_tm = getCurrentTime();
+
+    if (barrier_mode == BARRIER_SHM)
+    {
+        shmArrive();
+        return;
+    }
+
+    if (barrier_mode == BARRIER_TREE)
+    {
+        for (long c = 2 * r + 1; c <= 2 * r + 2 && c < ntotal; c++)
+        {
+            struct mymsgbuf sub;
+            if (chan->recv(chan, &sub, treeType(r), 0) < 0)
+            {
+                fprintf(stderr, "Runner %d can't receive message \"Ready\": %s\n", r, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            stats[r].children_ready++;
+        }
+    }
+
+    struct mymsgbuf ready = {(long) READY, r, 0, 0, {0}};
+    if (barrier_mode == BARRIER_TREE && r > 0)
+        ready.type = treeType((r - 1) / 2);
+
+    if (chan->send(chan, &ready, 0) < 0)
+    {
+        fprintf(stderr, "Runner %d can't send message \"Ready\": %s\n", r, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void barrierWait()
 {
-    printf("Judge: arrived at the stadium\n");
+    if (barrier_mode == BARRIER_SHM)
+    {
+        if (shmWait() < 0)
+        {
+            perror("Judge can't wait for runners");
+            exit(EXIT_FAILURE);
+        }
+        report("Judge: all runners are ready to start\n");
+        return;
+    }
 
-    for (int i = 0; i < nrunner; i++)
+    long nready = (barrier_mode == BARRIER_TREE) ? 1 : ntotal;
+    for (long i = 0; i < nready; i++)
     {
         struct mymsgbuf ready;
-        if (msgrcv(msgid, (struct msgbuf*) &ready, sizeof(struct mymsgbuf) - sizeof(long), (long) READY, 0) < 0)
+        if (recvTimed(&ready, (long) READY) < 0)
         {
             perror("Judge can't receive message \"Ready\"\n");
             exit(EXIT_FAILURE);
         }
-        printf("Judge: runner %d is ready to start\n", ready.num);
+
+        if (barrier_mode == BARRIER_TREE)
+            report("Judge: all runners are ready to start\n");
+        else
+            report("Judge: runner %d is ready to start\n", ready.num);
     }
+}
 
-    printf("Judge: START!\n");
 
-    double startRaceTm = getCurrentTime();
+/*  Arrive at the barrier on behalf of dead runner r
+    Returns 1 when it is done
+*/
+int barrierProxy(long r)
+{
+    if (barrier_mode == BARRIER_TREE)
+    {
+        long nchildren = 0;
+        for (long c = 2 * r + 1; c <= 2 * r + 2 && c < ntotal; c++)
+            nchildren++;
+
+        struct mymsgbuf sub;
+        while (stats[r].children_ready < nchildren &&
+               chan->recv(chan, &sub, treeType(r), IPC_NOWAIT) >= 0)
+            stats[r].children_ready++;
+
+        if (stats[r].children_ready < nchildren)
+            return 0;
+    }
 
-    struct mymsgbuf start = {(long) START, 0};
-    if (msgsnd(msgid, (struct msgbuf*) &start, sizeof(struct mymsgbuf) - sizeof(long), 0) < 0)
+    stats[r].ready_tm = getCurrentTime();
+
+    if (barrier_mode == BARRIER_SHM)
     {
-        fprintf(stderr, "Judge can't send message \"Start\": %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        shmArrive();
+        return 1;
     }
 
-    struct mymsgbuf finish;
-    if (msgrcv(msgid, (struct msgbuf*) &finish, sizeof(struct mymsgbuf) - sizeof(long), (long) FINISH, 0) < 0)
+    struct mymsgbuf ready = {(long) READY, (int) r, 0, 0, {0}};
+    if (barrier_mode == BARRIER_TREE && r > 0)
+        ready.type = treeType((r - 1) / 2);
+    chan->send(chan, &ready, 0);
+
+    return 1;
+}
+
+
+long treeType(long parent)
+{
+    return START + ntotal + parent;
+}
+
+
+void shmArrive()
+{
+    if (__atomic_add_fetch(&race->bar_count, 1, __ATOMIC_ACQ_REL) == ntotal)
     {
-        fprintf(stderr, "Judge can't receive message \"Finish\": %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        race->bar_count = 0;
+        __atomic_store_n(&race->bar_sense, !race->bar_sense, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &race->bar_sense, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
     }
+}
+
+
+/*  Wait until the sense of the barrier is flipped
+    In supervisor mode gives up after timeout seconds
+*/
+int shmWait()
+{
+    const int sense = 0;
+    struct timespec ts = {timeout, 0};
 
-    if (finish.num != nrunner - 1)
+    while (__atomic_load_n(&race->bar_sense, __ATOMIC_ACQUIRE) == sense)
     {
-        fprintf(stderr, "Violation of the order runners\n");
-        exit(EXIT_FAILURE);
+        int res = syscall(SYS_futex, &race->bar_sense, FUTEX_WAIT, sense,
+                          supervise ? &ts : NULL, NULL, 0);
+        if (res < 0 && errno == ETIMEDOUT)
+            return -1;
     }
 
-    double finishRaceTm = getCurrentTime();
-    printf("Judge: race finish, total time: %.2lf\n", finishRaceTm - startRaceTm);
+    return 0;
+}
 
-    exit(EXIT_SUCCESS);
+
+struct channel* msgChannelInit()
+{
+    struct channel* ch = (struct channel*) calloc(1, sizeof(struct channel));
+
+    if ((ch->msgid = msgget(IPC_PRIVATE, 0700)) == -1)
+    {
+        perror("Cant get msgid");
+        exit(-1);
+    }
+
+    struct msqid_ds ds;
+    queueId = ch->msgid;
+    queueOwner = getpid();
+    atexit(removeQueue);
+
+    if (msgctl(ch->msgid, IPC_STAT, &ds) < 0)
+    {
+        perror("Cant get msg stat");
+        exit(-1);
+    }
+    ch->window = ds.msg_qbytes / (offsetof(struct mymsgbuf, baton) - sizeof(long) + batch * sizeof(int));
+    if (ch->window < 1)
+        ch->window = 1;
+
+    ch->send = msgSend;
+    ch->recv = msgRecv;
+    ch->clear = msgClear;
+
+    return ch;
+}
+
+
+int msgSend(struct channel* ch, const struct mymsgbuf* msg, int flags)
+{
+    size_t size = offsetof(struct mymsgbuf, baton) - sizeof(long) + msg->count * sizeof(int);
+    return msgsnd(ch->msgid, (const struct msgbuf*) msg, size, flags);
 }
 
-void runner(int i)
+
+int msgRecv(struct channel* ch, struct mymsgbuf* msg, long type, int flags)
 {
-    printf("Runner %d: arrived at the stadium\n", i);
+    return msgrcv(ch->msgid, (struct msgbuf*) msg, sizeof(struct mymsgbuf) - sizeof(long), type, flags);
+}
 
-    struct mymsgbuf ready = {(long) READY, i};
-    if (msgsnd(msgid, (struct msgbuf*) &ready, sizeof(struct mymsgbuf) - sizeof(long), 0) < 0)
+
+void msgClear(struct channel* ch)
+{
+    if (msgctl(ch->msgid, IPC_RMID, NULL) < 0)
     {
-        fprintf(stderr, "Runner %d can't send message \"Ready\": %s\n", i, strerror(errno));
-        exit(EXIT_FAILURE);
+        perror("Cant remove msg");
     }
+    queueId = -1;
+    free(ch);
+}
+
+
+/*  box 0 - READY, box 1 - FINISH, box 2 + i - START + i,
+    box 2 + ntotal + i - ready subtree of runner i
+    READY box can hold message of every runner, so runners never
+    block on it
+*/
+struct channel* boxChannelInit()
+{
+    struct channel* ch = (struct channel*) calloc(1, sizeof(struct channel));
 
-    struct mymsgbuf start;
-    if (msgrcv(msgid, (struct msgbuf*) &start, sizeof(struct mymsgbuf) - sizeof(long), (long) START + i, 0) < 0)
+    //READY, FINISH, START of every runner and, for the tree barrier,
+    //READY of every subtree
+    ch->nboxes = (barrier_mode == BARRIER_TREE) ? 2 * ntotal + 2 : ntotal + 2;
+    ch->boxes = (struct mailbox*) calloc(ch->nboxes, sizeof(struct mailbox));
+    for (long i = 0; i < ch->nboxes; i++)
     {
-        fprintf(stderr, "Runner %d can't receive message \"Start\": %s\n", i, strerror(errno));
-        exit(EXIT_FAILURE);
+        struct mailbox* box = ch->boxes + i;
+        box->cap = MAILBOX_CAP;
+        if (i == 0 && barrier_mode == BARRIER_LINEAR)
+            box->cap = ntotal;
+        box->msgs = (struct mymsgbuf*) calloc(box->cap, sizeof(struct mymsgbuf));
+
+        pthread_mutex_init(&box->mutex, NULL);
+        pthread_cond_init(&box->cond_empty, NULL);
+        pthread_cond_init(&box->cond_full, NULL);
+    }
+
+    ch->window = LONG_MAX;
+    ch->send = boxSend;
+    ch->recv = boxRecv;
+    ch->clear = boxClear;
+
+    return ch;
+}
+
+
+struct mailbox* boxOf(struct channel* ch, long type)
+{
+    if (type == READY)
+        return ch->boxes;
+    if (type == FINISH)
+        return ch->boxes + 1;
+    if (type >= START && type - START < ch->nboxes - 2)
+        return ch->boxes + 2 + (type - START);
+
+    errno = EINVAL;
+    return NULL;
+}
+
+
+int boxSend(struct channel* ch, const struct mymsgbuf* msg, int flags)
+{
+    struct mailbox* box = boxOf(ch, msg->type);
+    if (!box)
+        return -1;
+
+    pthread_mutex_lock(&box->mutex);
+    while (box->count == box->cap)
+    {
+        if (flags & IPC_NOWAIT)
+        {
+            pthread_mutex_unlock(&box->mutex);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&box->cond_full, &box->mutex);
     }
-    printf("Runner %d: start\n", i);
 
-    srand(time(NULL) + getpid());
-    usleep((rand() % 100) * 10000);
+    box->msgs[(box->head + box->count) % box->cap] = *msg;
+    box->count++;
+
+    pthread_cond_signal(&box->cond_empty);
+    pthread_mutex_unlock(&box->mutex);
+
+    return 0;
+}
+
 
-    printf("Runner %d: finish\n", i);
+int boxRecv(struct channel* ch, struct mymsgbuf* msg, long type, int flags)
+{
+    struct mailbox* box = boxOf(ch, type);
+    if (!box)
+        return -1;
 
-    if (i != nrunner - 1)
+    pthread_mutex_lock(&box->mutex);
+    while (box->count == 0)
     {
-        struct mymsgbuf start = {START + i + 1, 0};
-        if (msgsnd(msgid, (struct msgbuf*) &start, sizeof(struct mymsgbuf) - sizeof(long), 0) < 0)
+        if (flags & IPC_NOWAIT)
         {
-            fprintf(stderr, "Runner %d can't send message \"Start %d\": %s\n", i, i + 1, strerror(errno));
-            exit(EXIT_FAILURE);
+            pthread_mutex_unlock(&box->mutex);
+            errno = ENOMSG;
+            return -1;
         }
+        pthread_cond_wait(&box->cond_empty, &box->mutex);
     }
-    else
+
+    *msg = box->msgs[box->head];
+    box->head = (box->head + 1) % box->cap;
+    box->count--;
+
+    pthread_cond_signal(&box->cond_full);
+    pthread_mutex_unlock(&box->mutex);
+
+    return 0;
+}
+
+
+void boxClear(struct channel* ch)
+{
+    for (long i = 0; i < ch->nboxes; i++)
+    {
+        struct mailbox* box = ch->boxes + i;
+        pthread_mutex_destroy(&box->mutex);
+        pthread_cond_destroy(&box->cond_empty);
+        pthread_cond_destroy(&box->cond_full);
+        free(box->msgs);
+    }
+    free(ch->boxes);
+    free(ch);
+}
+
+
+/*  Parse list of cpus in format "0,2,4-7"
+    Returns number of cpus in list or 0 on error
+*/
+int parseCpuList(const char* str, int** list)
+{
+    int n = 0;
+    int cap = 16;
+    int* res = (int*) malloc(cap * sizeof(int));
+    const char* p = str;
+
+    while (*p)
     {
-        struct mymsgbuf finish = {FINISH, i};
-        if (msgsnd(msgid, (struct msgbuf*) &finish, sizeof(struct mymsgbuf) - sizeof(long), 0) < 0)
+        char* end = NULL;
+        long from = strtol(p, &end, 10);
+        if (end == p || from < 0)
         {
-            fprintf(stderr, "Runner %d can't send message \"Finish\": %s\n", i, strerror(errno));
-            exit(EXIT_FAILURE);
+            free(res);
+            return 0;
+        }
+
+        long to = from;
+        if (*end == '-')
+        {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if (end == p || to < from)
+            {
+                free(res);
+                return 0;
+            }
+        }
+
+        for (long cpu = from; cpu <= to; cpu++)
+        {
+            if (n == cap)
+            {
+                cap *= 2;
+                res = (int*) realloc(res, cap * sizeof(int));
+            }
+            res[n++] = (int) cpu;
+        }
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0' && *end != '\n')
+        {
+            free(res);
+            return 0;
         }
+        p = end;
     }
 
-    exit(EXIT_SUCCESS);
+    *list = res;
+    return n;
 }
 
-double getCurrentTime()
+
+int readSysInt(const char* fmt, int cpu)
+{
+    char path[256];
+    snprintf(path, sizeof(path), fmt, cpu);
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    int val = 0;
+    if (fscanf(f, "%d", &val) != 1)
+        val = 0;
+    fclose(f);
+
+    return val;
+}
+
+
+int cpuNode(int cpu)
 {
-    struct timeval tv = {0, 0};
-    gettimeofday(&tv, NULL);
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = opendir(path);
+    if (!dir)
+        return 0;
 
-    return tv.tv_sec + (double) (tv.tv_usec) / 1000000;
+    int node = 0;
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir)))
+    {
+        if (!strncmp(ent->d_name, "node", 4) && sscanf(ent->d_name + 4, "%d", &node) == 1)
+            break;
+    }
+    closedir(dir);
+
+    return node;
+}
+
+
+void topologyInit()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+    {
+        perror("Cant get affinity");
+        exit(-1);
+    }
+
+    cpus = (struct cpuinfo*) calloc(CPU_COUNT(&set), sizeof(struct cpuinfo));
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+
+        struct cpuinfo* c = cpus + ncpu++;
+        c->cpu = cpu;
+        c->core = readSysInt("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        c->package = readSysInt("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        c->node = cpuNode(cpu);
+    }
+
+    //compact and numa: consecutive runners share core, then package, then node
+    qsort(cpus, ncpu, sizeof(struct cpuinfo), cmpCompact);
+
+    if (pin_mode == PIN_SCATTER)
+        orderScatter();
+}
+
+
+int cmpCompact(const void* a, const void* b)
+{
+    const struct cpuinfo* x = (const struct cpuinfo*) a;
+    const struct cpuinfo* y = (const struct cpuinfo*) b;
+
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+
+/*  Reorder compact list so that consecutive runners land on
+    different packages first and on different cores second
+*/
+void orderScatter()
+{
+    struct cpuinfo* res = (struct cpuinfo*) calloc(ncpu, sizeof(struct cpuinfo));
+    char* used = (char*) calloc(ncpu, 1);
+
+    int last_package = -1;
+    int last_core = -1;
+    for (int n = 0; n < ncpu; n++)
+    {
+        int best = -1;
+        int best_score = -1;
+        for (int j = 0; j < ncpu; j++)
+        {
+            if (used[j])
+                continue;
+
+            int score = (cpus[j].package != last_package) * 2 +
+                        (cpus[j].core != last_core);
+            if (score > best_score)
+            {
+                best = j;
+                best_score = score;
+            }
+        }
+
+        used[best] = 1;
+        res[n] = cpus[best];
+        last_package = res[n].package;
+        last_core = res[n].core;
+    }
+
+    free(cpus);
+    free(used);
+    cpus = res;
+}
+
+
+/*  Pin calling runner according to pin mode
+    Returns cpu number or -1 if runner is not pinned
+*/
+int placeRunner(int i)
+{
+    int cpu = -1;
+
+    switch (pin_mode)
+    {
+        case PIN_NONE:
+            return -1;
+        case PIN_LIST:
+            cpu = pin_list[i % npin_list];
+            break;
+        case PIN_COMPACT:
+        case PIN_SCATTER:
+            cpu = cpus[i % ncpu].cpu;
+            break;
+        case PIN_NUMA:
+        {
+            //split runners into contiguous blocks, one block per node
+            int nnode = 1;
+            for (int j = 1; j < ncpu; j++)
+                if (cpus[j].node != cpus[j - 1].node)
+                    nnode++;
+
+            int node = (int) ((long long) i * nnode / ntotal);
+            int first = 0;
+            for (int j = 1, k = 0; j < ncpu && k < node; j++)
+            {
+                if (cpus[j].node != cpus[j - 1].node)
+                {
+                    k++;
+                    first = j;
+                }
+            }
+
+            int size = 0;
+            while (first + size < ncpu && cpus[first + size].node == cpus[first].node)
+                size++;
+
+            long block_start = (ntotal * node + nnode - 1) / nnode;
+            cpu = cpus[first + (i - block_start) % size].cpu;
+            break;
+        }
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    {
+        fprintf(stderr, "Runner %d can't pin to cpu %d: %s\n", i, cpu, strerror(errno));
+        return -1;
+    }
+
+    return cpu;
+}
+
+
+void fillPlacement(struct runner_stat* st)
+{
+    st->cpu = sched_getcpu();
+    st->core = readSysInt("/sys/devices/system/cpu/cpu%d/topology/core_id", st->cpu);
+    st->package = readSysInt("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", st->cpu);
+    st->node = cpuNode(st->cpu);
+}
+
+
+enum HOP_CLASS hopClass(const struct runner_stat* from, const struct runner_stat* to)
+{
+    if (from->package != to->package)
+        return HOP_CROSS_SOCKET;
+    if (from->core != to->core)
+        return HOP_CROSS_CORE;
+    return HOP_SAME_CORE;
+}
+
+
+void printPlacement()
+{
+    const char* names[HOP_NCLASS] = {"same-core", "cross-core", "cross-socket"};
+    double sum[HOP_NCLASS] = {0};
+    long   count[HOP_NCLASS] = {0};
+
+    report("Judge: placement report\n");
+    report("%8s %5s %5s %7s %5s %12s  %s\n",
+           "runner", "cpu", "core", "socket", "node", "hop, us", "hop from previous");
+
+    for (int i = 0; i < ntotal; i++)
+    {
+        const char* name = "judge";
+        if (i % nrunner != 0)
+        {
+            enum HOP_CLASS cls = hopClass(stats + i - 1, stats + i);
+            sum[cls] += stats[i].hop;
+            count[cls]++;
+            name = names[cls];
+        }
+
+        report("%8d %5d %5d %7d %5d %12.2lf  %s\n", i, stats[i].cpu, stats[i].core,
+               stats[i].package, stats[i].node, stats[i].hop * 1e6, name);
+    }
+
+    for (int cls = 0; cls < HOP_NCLASS; cls++)
+    {
+        if (count[cls])
+            printf("Judge: %-12s hops: %6ld, average latency: %.2lf us\n",
+                   names[cls], count[cls], sum[cls] / count[cls] * 1e6);
+    }
 }
@@ -2,10 +2,21 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <semaphore.h>
+#include <pthread.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sem.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <string.h>
 
 
@@ -18,10 +29,21 @@ do{                                                                        \
     }                                                                      \
 } while(0);
 
+#define say(...)                    \
+do{                                 \
+    if (!quiet)                     \
+        printf(__VA_ARGS__);        \
+} while(0)
+
 
 enum
 {
     ARGC = 5,
+    NOPS_MAX = 3,       //operations in one semop call
+    SEMVMX = 32767,     //max value of System V semaphore
+    BACKOFF_MAX = 1000, //us, posix backend polling for zero and idle workers
+    THREAD_STACK = 64 * 1024,
+    NRESOURCES = 8
 };
 
 enum SEM
@@ -29,7 +51,10 @@ enum SEM
     SHIP = 0,
     LADD,
     SLEEP,
-    END
+    END,
+    BOARD,
+    DEPART,
+    NSEMS
 };
 
 /*  sem[SHIP]   - number of available seats on ship
@@ -37,30 +62,359 @@ enum SEM
     sem[SLEEP]  - used to keep passengers from leaving the ship
                   before departure
     sem[END}    - used to finish program
+    sem[BOARD]  - number of passengers boarded during this stop,
+                  used in event mode
+    sem[DEPART] - one token for every passenger carried, used instead
+                  of sem[SLEEP] in event mode, where ship does not
+                  stay closed long enough to be seen by zero waiters
+*/
+
+/*  Passenger states, each transition is one step of the protocol
+*/
+enum PASS_STATE
+{
+    TICKET = 0,     //wants to buy a ticket
+    BOARDING,       //has a ticket, waits for ladder
+    SAILING,        //on the ship, waits for departure
+    LEAVING,        //waits for ladder to go to beach
+    ASHORE,         //cruises are over
+    NSTATES
+};
+
+/*  semop calls made by passengers and ship, filled in profile mode
+*/
+struct profile
+{
+    long pass_semops;
+    long ship_semops;
+    long boardings;
+    long pass_kb;       //memory of passengers
+};
+
+/*  struct sembuf with int sem_op, so capacities are limited only
+    by semaphore implementation
+*/
+struct wsembuf
+{
+    unsigned short sem_num;
+    int            sem_op;
+    short          sem_flg;
+};
+
+/*  Semaphore set implementation, op has semantics of semop
 */
+struct sem_backend
+{
+    const char* name;
+    long max;           //max semaphore value
+    void (*init)(const int nsems);
+    int  (*op)(struct wsembuf* ops, size_t nops);
+    void (*clear)();
+};
+
+/*  Ship of a fleet, in shared memory
+*/
+struct ship_stat
+{
+    long queued;        //passengers which chose ship and have not boarded yet
+    long boardings;
+    long cruises;
+    int  ended;
+};
+
+enum BALANCE
+{
+    LEAST = 0,          //least queued ship
+    TWO                 //less queued of two random ships
+};
+
+/*  Passenger, in threads mode one of many in worker
+*/
+struct task
+{
+    long i;
+    int  state;
+    long ship;          //chosen ship, -1 if none
+};
+
+/*  Thread which runs a slice of passengers, M:N. If it has only one
+    passenger, it blocks in semop, otherwise it polls every passenger
+    with IPC_NOWAIT and sleeps when none of them moved
+*/
+struct worker
+{
+    pthread_t    thread;
+    struct task* tasks;
+    long         ntasks;
+};
+
+/*  Events of log, passenger's and ship's
+*/
+enum EVENT
+{
+    EV_WANT = 0,    //wants to buy a ticket
+    EV_TICKET,      //bought a ticket
+    EV_LADD_ON,     //stepped on ladder, split mode only
+    EV_LADD_OFF,    //stepped off ladder, split mode only
+    EV_BOARD,       //went on ship
+    EV_DEPART,      //ship has departed with passenger
+    EV_LEAVE,       //left ship and gave ticket back
+    EV_RETURN,      //gave ticket back at the end
+    EV_OPEN,        //ship opened ladder
+    EV_CLOSE        //ship closed ladder
+};
+
+struct event
+{
+    long  seq;      //order of events of all writers
+    long  tm;       //ns
+    int   who;      //passenger, -1 for ship
+    short type;
+    short ship;
+};
+
+/*  Lock-free event log in shared memory. Every writer (passenger
+    process, worker thread or ship) appends only to its own slot,
+    the only shared word is the sequence counter. Slots are big
+    enough for every event a passenger can make, so nothing is lost
+    and the log is merged by seq after the run.
+
+    An event which takes a place (seat, ladder step) is stamped after
+    its semop and an event which frees a place is stamped before it,
+    so loads seen in the log are never above real ones and the
+    checker gives no false alarms
+*/
+struct event_log
+{
+    long* seq;
+    long* nevents;          //per slot, slot of writer is its first passenger
+    struct event* events;
+    long slot;              //events per passenger
+    long nslots;            //passengers and ships
+};
+
+/*  Object which must be removed explicitly, see res_register
+*/
+struct resource
+{
+    const char* name;
+    int  id;
+    int  (*release)(const int id);
+};
+
+union semun
+{
+    int              val;
+    struct semid_ds* buf;
+    unsigned short*  array;
+};
+
+/*  Waiters for zero sleep on zseq, which is changed every time
+    val drops to zero, so a post wakes only those who wait for val
+*/
+struct fsem
+{
+    int val;
+    int zseq;
+    int waiters;        //wait to take 1
+    int big_waiters;    //wait to take more than 1
+    int zwaiters;       //wait for zero
+};
+
+void sysv_init(const int nsems);
+int  sysv_op(struct wsembuf* ops, size_t nops);
+void sysv_clear();
+
+void res_register(const char* name, const int id, int (*release)(const int id));
+int  res_release(const int id);
+void res_forget(const int id);
+void res_release_all();
+void res_signal(int sig);
+int  sem_remove(const int id);
+
+void futex_init(const int nsems);
+int  futex_op(struct wsembuf* ops, size_t nops);
+void futex_clear();
+void futex_wake(struct fsem* sem, int n);
+int  futex_wait(int* addr, int* waiters, int val);
+
+void posix_init(const int nsems);
+int  posix_op(struct wsembuf* ops, size_t nops);
+void posix_clear();
+
+struct sem_backend backends[] = {
+    {"sysv",  SEMVMX,        sysv_init,  sysv_op,  sysv_clear},
+    {"futex", INT_MAX,       futex_init, futex_op, futex_clear},
+    {"posix", SEM_VALUE_MAX, posix_init, posix_op, posix_clear}
+};
 
 char* progname;
 int   semid;
+const char* keyfile = NULL;     //names semaphore set
+int   nsysv = 0;                //semaphores of keyed set with lock and clean mark
+const char* ipc_setup = NULL;   //how semaphore set was got
+double ipc_time = 0;
 
-void ship(const short ship_cur, const short ladd_cap, const short nfloat);
-void init_ship(const short);
-void open_ladd(const short);
-void end_cruise(const short, const short);
-void close_ladd(const short);
+struct resource resources[NRESOURCES];
+int   nresources = 0;
+pid_t res_owner = 0;
+struct fsem* fsems = NULL;
+sem_t*       psems = NULL;
+int          nfsems = 0;
+struct sem_backend* backend = backends;
+int   quiet = 0;
 
-void passenger(const short i);
-void buy_ticket();
+int   split = 0;        //separate semop for every step, as before
+int   event = 0;        //depart when boarding is over instead of by timer
+int   profile = 0;
+long  nthreads = 0;     //passengers are run by threads instead of processes
+__thread long nsemop = 0;   //semop calls of current process or thread
+__thread long nboard = 0;
+struct profile* prof = NULL;
+
+long  nships = 1;
+int   balance = LEAST;
+struct ship_stat* fleet = NULL;
+__thread long sem_base = 0;     //semaphores of current ship
+__thread unsigned int seed = 1;
+
+int   logging = 0;
+struct event_log evlog = {NULL, NULL, NULL, 0, 0};
+__thread long log_first = 0;    //slot of current writer
+__thread long log_cap = 0;      //events in it
+
+void ship(const long k, const long ship_cur, const long ladd_cap,
+          const long nfloat, const long npass);
+void init_ship(const long);
+void open_ladd(const long, const short);
+void end_cruise(const long, const long);
+void close_ladd(const long, const long);
+long wait_boarding(const long);
+void fleet_report(const long ship_cap, const double time);
+long choose_ship(const long i);
+
+int  sem_call(struct wsembuf* ops, size_t nops);
+int  try_call(struct wsembuf* ops, size_t nops);
+void profile_report(const long nfloat, const long npass, const double time);
+double get_time();
+long self_pss();
+long parse_arg(const char* arg, const int num, const long max);
+
+void passenger(const long i);
+int  passenger_step(struct task* task, const short nowait);
+void run_threads(const long npass);
+void* worker(void* arg);
+int  buy_ticket(const short nowait);
 int  check_end();
 void return_ticket();
-void go_ship();
-void leave_ship();
-void enjoy();
+int  go_ship(const long i, const short nowait);
+int  leave_ship(const long i, const short nowait);
+int  enjoy(const short nowait);
+
+void log_init(const long npass, const long nfloat);
+void log_writer(const long first, const long npass);
+struct event log_stamp(const long who, const int type);
+void log_put(const struct event ev);
+void log_mark(const long who, const int type);
+int  log_check(const long npass, const long ship_cap, const long ladd_cap);
+void log_clear();
+void wait_report(const char* name, long* waits, const long n);
+int  cmp_seq(const void* a, const void* b);
+int  cmp_long(const void* a, const void* b);
 
 
 int main(int argc, char* argv[])
 {
     progname = argv[0];
 
+    struct option longopts[] = {
+        {"split", no_argument, NULL, 's'},
+        {"profile", no_argument, NULL, 'p'},
+        {"backend", required_argument, NULL, 'b'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"event", no_argument, NULL, 'e'},
+        {"threads", required_argument, NULL, 't'},
+        {"log", no_argument, NULL, 'l'},
+        {"ships", required_argument, NULL, 'n'},
+        {"balance", required_argument, NULL, 'a'},
+        {"key", required_argument, NULL, 'k'},
+        {0, 0, 0, 0}
+    };
+
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, "spb:qet:ln:a:k:", longopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'k':
+                keyfile = optarg;
+                break;
+            case 'n':
+                nships = strtol(optarg, NULL, 0);
+                if (nships <= 0 || nships > SHRT_MAX)
+                {
+                    printf("%s: invalid number of ships: %s\n", progname, optarg);
+                    return 0;
+                }
+                break;
+            case 'a':
+                if (!strcmp(optarg, "least"))
+                    balance = LEAST;
+                else if (!strcmp(optarg, "two"))
+                    balance = TWO;
+                else
+                {
+                    printf("%s: unknown balance: %s, expected: least or two\n",
+                           progname, optarg);
+                    return 0;
+                }
+                break;
+            case 'l':
+                logging = 1;
+                break;
+            case 't':
+                nthreads = strtol(optarg, NULL, 0);
+                if (nthreads <= 0)
+                {
+                    printf("%s: invalid number of threads: %s\n", progname, optarg);
+                    return 0;
+                }
+                break;
+            case 'e':
+                event = 1;
+                break;
+            case 'b':
+            {
+                size_t i = 0;
+                size_t n = sizeof(backends) / sizeof(backends[0]);
+                while (i < n && strcmp(optarg, backends[i].name))
+                    i++;
+                if (i == n)
+                {
+                    printf("%s: unknown backend: %s, expected: sysv, futex or posix\n",
+                           progname, optarg);
+                    return 0;
+                }
+                backend = backends + i;
+                break;
+            }
+            case 'q':
+                quiet = 1;
+                break;
+            case 's':
+                split = 1;
+                break;
+            case 'p':
+                profile = 1;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc != ARGC)
     {
         printf("%s: wrong number of arguments: %d, expected: %d\n",
@@ -68,55 +422,76 @@ int main(int argc, char* argv[])
         return 0;
     }
     
-    const short npass = (short) strtol(argv[1], 0, 0);
-    if (npass <= 0)
-    {
-        printf("%s: invalid argument 1: %d, expected number in range from 1 to 32767\n",
-               progname, npass);
+    const long npass = parse_arg(argv[1], 1, LONG_MAX);
+    //seats are doubled at the end of cruises
+    const long ship_cap = parse_arg(argv[2], 2, backend->max / 2);
+    const long ladd_cap = parse_arg(argv[3], 3, backend->max);
+    const long nfloat = parse_arg(argv[4], 4, LONG_MAX);
+    if (!npass || !ship_cap || !ladd_cap || !nfloat)
         return 0;
-    }
-    
-    const short ship_cap = (short) strtol(argv[2], 0, 0);
-    if (ship_cap <= 0)
+
+    //every ship has its own set of NSEMS semaphores
+    backend->init(NSEMS * nships);
+
+    fleet = (struct ship_stat*) mmap(NULL, nships * sizeof(struct ship_stat),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT("mmap", fleet != MAP_FAILED);
+
+    if (profile)
     {
-        printf("%s: invalid argument 2: %d, expected number in range from 1 to 32767\n",
-               progname, ship_cap);
-        return 0;
+        prof = (struct profile*) mmap(NULL, sizeof(struct profile), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        ASSERT("mmap", prof != MAP_FAILED);
     }
 
-    const short ladd_cap = (short) strtol(argv[3], 0, 0);
-    if (ladd_cap <= 0)
+    if (logging)
+        log_init(npass, nfloat);
+
+    double start = get_time();
+
+    for (long k = 0; k < nships; k++)
     {
-        printf("%s: invalid argument 3: %d, expected number in range from 1 to 32767\n",
-               progname, ladd_cap);
-        return 0;
+        pid_t pid = fork();
+        ASSERT("fork", pid != -1);
+        if (pid == 0)
+            ship(k, ship_cap, ladd_cap, nfloat, npass);
     }
 
-    const short nfloat = (short) strtol(argv[4], 0 ,0);
-    if (nfloat <= 0)
+    if (nthreads)
+        run_threads(npass);
+    else
     {
-        printf("%s: invalid argument 4: %d, expected number in range from 1 to 32767\n",
-               progname, nfloat);
-        return 0;
+        for (long i = 0; i < npass; i++)
+        {
+            //ship would wait forever for a passenger which was not born
+            pid_t pid = fork();
+            ASSERT("fork", pid != -1);
+            if (pid == 0)
+                passenger(i);
+        }
     }
 
-    semid = semget(IPC_PRIVATE, 4, 0700);
-    ASSERT("semget", semid != -1);
+    for (long i = 0; i < (nthreads ? 0 : npass) + nships; i++)
+        wait(NULL);
+
+    double time = get_time() - start;
 
-    if (fork() == 0)
-        ship(ship_cap, ladd_cap, nfloat); 
+    backend->clear();
 
-    for (short i = 0; i < npass; i++)
+    if (profile)
+        profile_report(nfloat * nships, npass, time);
+
+    if (nships > 1)
+        fleet_report(ship_cap, time);
+    munmap(fleet, nships * sizeof(struct ship_stat));
+
+    if (logging)
     {
-        if (fork() == 0)
-            passenger(i);
+        int ok = log_check(npass, ship_cap, ladd_cap);
+        log_clear();
+        if (!ok)
+            return EXIT_FAILURE;
     }
-    
-    for (short i = 0; i < npass + 1; i++)
-        wait(NULL);
-
-    int ctl = semctl(semid, 0, IPC_RMID, 0);
-    ASSERT("semctl", ctl != -1);
 
     printf("Success\n");
 
@@ -124,120 +499,596 @@ int main(int argc, char* argv[])
 }
 
 
-void ship(const short ship_cap, const short ladd_cap, const short nfloat)
+void ship(const long k, const long ship_cap, const long ladd_cap,
+          const long nfloat, const long npass)
 {
+    sem_base = k * NSEMS;
+    log_writer(npass + k, 1);
     init_ship(ship_cap);
 
-    for (short i = 0; i < nfloat; i++)
+    //in event mode ship leaves when it is full or everybody is on board
+    const long nboarding = (npass < ship_cap) ? npass : ship_cap;
+
+    for (long i = 0; i < nfloat; i++)
     {
-        printf("Ship: sailed to beach\n");
+        say("Ship %ld: sailed to beach\n", k);
 
-        open_ladd(ladd_cap);
-        usleep(100000);
+        open_ladd(ladd_cap, SEM_UNDO);
+        long ncarried = nboarding;
+        if (event)
+            ncarried = wait_boarding(nboarding);
+        else
+            usleep(100000);
 
-        close_ladd(ladd_cap);
-        usleep(100000);
+        close_ladd(ladd_cap, ncarried);
+        __atomic_add_fetch(&fleet[k].cruises, 1, __ATOMIC_RELAXED);
+        if (!event)
+            usleep(100000);
     }
 
+    //passengers which see the end choose another ship
+    __atomic_store_n(&fleet[k].ended, 1, __ATOMIC_SEQ_CST);
     end_cruise(ship_cap, ladd_cap);
 
-    printf("Ship: leave beach\n");
+    say("Ship %ld: leave beach\n", k);
+
+    if (profile)
+        __atomic_add_fetch(&prof->ship_semops, nsemop, __ATOMIC_RELAXED);
 
     exit(EXIT_SUCCESS);
 }
 
 
-void passenger(const short i)
+void passenger(const long i)
 {
-    while(1)
+    struct task task = {i, TICKET, -1};
+
+    seed = i + 1;
+    log_writer(i, 1);
+    say("Passenger %2ld: want to go to ship\n", i);
+    log_mark(i, EV_WANT);
+    while (task.state != ASHORE)
+        passenger_step(&task, 0);
+
+    if (profile)
+    {
+        __atomic_add_fetch(&prof->pass_semops, nsemop, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&prof->boardings, nboard, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&prof->pass_kb, self_pss(), __ATOMIC_RELAXED);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+
+/*  Moves passenger to the next state, returns 0 if it would block,
+    which is possible only with IPC_NOWAIT
+*/
+int passenger_step(struct task* task, const short nowait)
+{
+    const long i = task->i;
+
+    if (task->ship == -1)
+    {
+        task->ship = choose_ship(i);
+        if (task->ship == -1)
+        {
+            say("Passenger %2ld: leave the beach\n", i);
+            task->state = ASHORE;
+            return 1;
+        }
+        __atomic_add_fetch(&fleet[task->ship].queued, 1, __ATOMIC_RELAXED);
+    }
+    sem_base = task->ship * NSEMS;
+
+    switch (task->state)
     {
-        printf("Passenger %2d: want to go to ship\n", i);
-        buy_ticket();
-        if (check_end())
+        case TICKET:
+            if (buy_ticket(nowait) == -1)
+                return 0;
+            log_mark(i, EV_TICKET);
+
+            if (check_end())
+            {
+                struct event ev = log_stamp(i, EV_RETURN);
+                return_ticket();
+                log_put(ev);
+                __atomic_sub_fetch(&fleet[task->ship].queued, 1, __ATOMIC_RELAXED);
+
+                //try another ship of the fleet
+                task->ship = choose_ship(i);
+                if (task->ship == -1)
+                {
+                    say("Passenger %2ld: leave the beach\n", i);
+                    task->state = ASHORE;
+                }
+                else
+                    __atomic_add_fetch(&fleet[task->ship].queued, 1, __ATOMIC_RELAXED);
+            }
+            else
+                task->state = BOARDING;
+            break;
+
+        case BOARDING:
+            if (go_ship(i, nowait) == -1)
+                return 0;
+
+            nboard++;
+            __atomic_sub_fetch(&fleet[task->ship].queued, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&fleet[task->ship].boardings, 1, __ATOMIC_RELAXED);
+            say("Passenger %2ld: went on ship %ld\n", i, task->ship);
+            task->state = SAILING;
             break;
-             
-        go_ship();
-        printf("Passenger %2d: went on ship\n", i);
 
-        enjoy();
+        case SAILING:
+            if (enjoy(nowait) == -1)
+                return 0;
+            log_mark(i, EV_DEPART);
+
+            say("Passenger %2ld: leave the ship\n", i);
+            task->state = LEAVING;
+            break;
 
-        printf("Passenger %2d: leave the ship\n", i);
-        leave_ship();
+        case LEAVING:
+            if (leave_ship(i, nowait) == -1)
+                return 0;
+            task->ship = -1;
+
+            say("Passenger %2ld: want to go to ship\n", i);
+            log_mark(i, EV_WANT);
+            task->state = TICKET;
+            break;
     }
 
-    return_ticket();
-    printf("Passenger %2d: leave the beach\n", i);
+    return 1;
+}
 
-    exit(EXIT_SUCCESS);
+
+/*  Passengers are split between nthreads workers of this process
+*/
+void run_threads(const long npass)
+{
+    const long nworkers = (nthreads < npass) ? nthreads : npass;
+
+    struct task* tasks = (struct task*) calloc(npass, sizeof(struct task));
+    struct worker* workers = (struct worker*) calloc(nworkers, sizeof(struct worker));
+    ASSERT("calloc", tasks && workers);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+
+    long first = 0;
+    for (long w = 0; w < nworkers; w++)
+    {
+        workers[w].tasks = tasks + first;
+        workers[w].ntasks = npass / nworkers + (w < npass % nworkers);
+
+        for (long k = first; k < first + workers[w].ntasks; k++)
+        {
+            tasks[k].i = k;
+            tasks[k].state = TICKET;
+            tasks[k].ship = -1;
+        }
+        first += workers[w].ntasks;
+
+        errno = pthread_create(&workers[w].thread, &attr, worker, workers + w);
+        ASSERT("pthread_create", errno == 0);
+    }
+    pthread_attr_destroy(&attr);
+
+    //all passengers are on their way, measure them while they run
+    if (profile)
+        prof->pass_kb = self_pss();
+
+    for (long w = 0; w < nworkers; w++)
+        pthread_join(workers[w].thread, NULL);
+
+    free(workers);
+    free(tasks);
 }
 
 
-void init_ship(const short ship_cap)
+void* worker(void* arg)
 {
-    struct sembuf init = {SHIP, ship_cap, 0};
-    int res = semop(semid, &init, 1);
-    ASSERT("semop", res != -1);
+    struct worker* w = (struct worker*) arg;
+    const short nowait = (w->ntasks > 1) ? IPC_NOWAIT : 0;
+
+    seed = w->tasks[0].i + 1;
+    log_writer(w->tasks[0].i, w->ntasks);
+    for (long k = 0; k < w->ntasks; k++)
+    {
+        say("Passenger %2ld: want to go to ship\n", w->tasks[k].i);
+        log_mark(w->tasks[k].i, EV_WANT);
+    }
+
+    long nactive = w->ntasks;
+    long first = 0;
+    useconds_t backoff = 1;
+
+    //ships of a fleet block independently, a full ship must not
+    //stop passengers queued for another one
+    char* blocked = (char*) malloc(NSTATES * nships);
+    ASSERT("malloc", blocked);
+
+    while (nactive)
+    {
+        //after one passenger would block in some state of a ship,
+        //the others in that state wait for the next pass
+        memset(blocked, 0, NSTATES * nships);
+        int moved = 0;
+
+        for (long k = 0; k < w->ntasks; k++)
+        {
+            struct task* task = w->tasks + (first + k) % w->ntasks;
+            if (task->state == ASHORE)
+                continue;
+            if (task->ship != -1 && blocked[task->ship * NSTATES + task->state])
+                continue;
+
+            if (!passenger_step(task, nowait))
+            {
+                blocked[task->ship * NSTATES + task->state] = 1;
+                continue;
+            }
+
+            moved = 1;
+            if (task->state == ASHORE)
+                nactive--;
+        }
+        first = (first + 1) % w->ntasks;
+
+        if (moved)
+            backoff = 1;
+        else
+        {
+            usleep(backoff);
+            if (backoff < BACKOFF_MAX)
+                backoff *= 2;
+        }
+    }
+    free(blocked);
+
+    if (profile)
+    {
+        __atomic_add_fetch(&prof->pass_semops, nsemop, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&prof->boardings, nboard, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
 }
 
 
-void open_ladd(const short ladd_cap)
+/*  Operations are on semaphores of current ship
+*/
+int sem_call(struct wsembuf* ops, size_t nops)
 {
-    //forbid to leave the ship before departure
-    struct sembuf forbid = {SLEEP, 1, 0};
-    int res = semop(semid, &forbid, 1);
+    struct wsembuf sops[NOPS_MAX];
+    for (size_t i = 0; i < nops; i++)
+    {
+        sops[i] = ops[i];
+        sops[i].sem_num += sem_base;
+    }
+
+    nsemop++;
+    return backend->op(sops, nops);
+}
+
+
+/*  sem_call for a step of passenger, only the first operation may block.
+    Returns -1 if it would block with IPC_NOWAIT
+*/
+int try_call(struct wsembuf* ops, size_t nops)
+{
+    int res = sem_call(ops, nops);
+    if (res == -1 && errno == EAGAIN && (ops[0].sem_flg & IPC_NOWAIT))
+        return -1;
+
     ASSERT("semop", res != -1);
-    
-    //open ladder
-    printf("Ship: open ladder\n");
-    struct sembuf open = {LADD, ladd_cap, 0};
-    res = semop(semid, &open, 1); 
+    return 0;
+}
+
+
+/*  Argument num of command line, 0 if it is invalid
+*/
+long parse_arg(const char* arg, const int num, const long max)
+{
+    char* end = NULL;
+    errno = 0;
+    long val = strtol(arg, &end, 0);
+    if (errno || *end || val <= 0 || val > max)
+    {
+        printf("%s: invalid argument %d: %s, expected number in range from 1 to %ld\n",
+               progname, num, arg, max);
+        return 0;
+    }
+
+    return val;
+}
+
+
+/*  Proportional resident memory of calling process, kB
+*/
+long self_pss()
+{
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    long pss = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "Pss: %ld", &pss) == 1)
+            break;
+    }
+    fclose(f);
+
+    return pss;
+}
+
+
+double get_time()
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
+}
+
+
+void profile_report(const long nfloat, const long npass, const double time)
+{
+    long total = prof->pass_semops + prof->ship_semops;
+    printf("Profile (%s, %s%s): %ld cruises, %ld boardings in %.3lf s, "
+           "%.0lf boardings/s, %.1lf cruises/s\n",
+           backend->name, split ? "split" : "atomic", event ? ", event" : "",
+           nfloat, prof->boardings, time, prof->boardings / time, nfloat / time);
+    printf("Profile: semop calls: passengers %ld, ship %ld, total %ld\n",
+           prof->pass_semops, prof->ship_semops, total);
+    if (prof->boardings)
+        printf("Profile: %.2lf semop calls per passenger per cruise\n",
+               (double) prof->pass_semops / prof->boardings);
+    printf("Profile: %.2lf semop calls per cruise\n", (double) total / nfloat);
+    printf("Profile: %s, %.2lf kB of memory per passenger\n",
+           nthreads ? "threads" : "processes", (double) prof->pass_kb / npass);
+    if (ipc_setup)
+        printf("Profile: semaphore set %s in %.1lf us\n", ipc_setup, ipc_time * 1e6);
+}
+
+
+void init_ship(const long ship_cap)
+{
+    struct wsembuf init = {SHIP, ship_cap, 0};
+    int res = sem_call(&init, 1);
     ASSERT("semop", res != -1);
 }
 
 
-void close_ladd(const short ladd_cap)
+/*  In atomic mode every transition is one semop, so it is never seen
+    half-done. Operations which are balanced within one process use
+    SEM_UNDO, so a crashed passenger gives its seat back
+*/
+void open_ladd(const long ladd_cap, const short undo)
 {
-    //close ladder
-    printf("Ship: close ladder\n");
-    struct sembuf close = {LADD, -ladd_cap, 0};
-    int res = semop(semid, &close, 1);
+    //ladder is logged open before it is, see struct event_log
+    struct event ev = log_stamp(-1, EV_OPEN);
+
+    if (split)
+    {
+        //wait when all passengers of previous cruise are ready to leave
+        if (event)
+        {
+            struct wsembuf departed = {DEPART, 0, 0};
+            int res = sem_call(&departed, 1);
+            ASSERT("semop", res != -1);
+        }
+
+        //forbid to leave the ship before departure
+        struct wsembuf forbid = {SLEEP, 1, 0};
+        int res = sem_call(&forbid, 1);
+        ASSERT("semop", res != -1);
+
+        //open ladder
+        say("Ship %ld: open ladder\n", sem_base / NSEMS);
+        struct wsembuf open = {LADD, ladd_cap, 0};
+        res = sem_call(&open, 1);
+        ASSERT("semop", res != -1);
+        log_put(ev);
+        return;
+    }
+
+    //forbid to leave the ship before departure and open ladder,
+    //in event mode after all passengers of previous cruise are ready to leave
+    say("Ship %ld: open ladder\n", sem_base / NSEMS);
+    struct wsembuf open[3] = {{DEPART, 0, 0}, {SLEEP, 1, undo}, {LADD, ladd_cap, undo}};
+    int res = event ? sem_call(open, 3) : sem_call(open + 1, 2);
     ASSERT("semop", res != -1);
+    log_put(ev);
+}
 
-    //allow to leave the ship
-    struct sembuf allow = {SLEEP, -1, 0};
-    res = semop(semid, &allow, 1);
+
+void close_ladd(const long ladd_cap, const long ncarried)
+{
+    say("Ship %ld: close ladder\n", sem_base / NSEMS);
+
+    if (split)
+    {
+        //close ladder
+        struct wsembuf close = {LADD, -ladd_cap, 0};
+        int res = sem_call(&close, 1);
+        ASSERT("semop", res != -1);
+        log_mark(-1, EV_CLOSE);
+
+        //allow to leave the ship
+        struct wsembuf allow = {SLEEP, -1, 0};
+        res = sem_call(&allow, 1);
+        ASSERT("semop", res != -1);
+
+        if (event)
+        {
+            struct wsembuf depart = {DEPART, ncarried, 0};
+            res = sem_call(&depart, 1);
+            ASSERT("semop", res != -1);
+        }
+        return;
+    }
+
+    //close ladder and allow to leave the ship
+    struct wsembuf close[3] = {{LADD, -ladd_cap, SEM_UNDO}, {SLEEP, -1, SEM_UNDO},
+                              {DEPART, ncarried, 0}};
+    int res = sem_call(close, event ? 3 : 2);
     ASSERT("semop", res != -1);
+    log_mark(-1, EV_CLOSE);
+}
+
+
+/*  Wait until n passengers boarded, then ladder is closed as soon
+    as the last of them leaves it. Passengers which came after them
+    wait for the next cruise, so there are exactly n on board.
+
+    In a fleet passengers may all be on other ships, so ship takes
+    them one by one and departs with those who came when nobody else
+    is queued for it. Returns number of passengers taken
+*/
+long wait_boarding(const long n)
+{
+    if (nships == 1)
+    {
+        struct wsembuf boarded = {BOARD, -n, 0};
+        int res = sem_call(&boarded, 1);
+        ASSERT("semop", res != -1);
+        return n;
+    }
+
+    const long k = sem_base / NSEMS;
+    long nboarded = 0;
+    useconds_t backoff = 1;
+    while (nboarded < n)
+    {
+        struct wsembuf boarded = {BOARD, -1, IPC_NOWAIT};
+        if (try_call(&boarded, 1) == 0)
+        {
+            nboarded++;
+            backoff = 1;
+            continue;
+        }
+
+        //passengers leave the queue after they boarded, so the last
+        //of them is taken after the queue is seen empty
+        if (nboarded > 0 && __atomic_load_n(&fleet[k].queued, __ATOMIC_SEQ_CST) == 0)
+        {
+            if (try_call(&boarded, 1) == 0)
+            {
+                nboarded++;
+                continue;
+            }
+            break;
+        }
+
+        usleep(backoff);
+        if (backoff < BACKOFF_MAX)
+            backoff *= 2;
+    }
+
+    return nboarded;
+}
+
+
+/*  Ship for passenger which has no ticket yet, -1 if all ships ended
+*/
+long choose_ship(const long i)
+{
+    if (balance == TWO && nships > 1)
+    {
+        long a = rand_r(&seed) % nships;
+        long b = rand_r(&seed) % nships;
+        if (!fleet[a].ended && !fleet[b].ended)
+            return (fleet[b].queued < fleet[a].queued) ? b : a;
+    }
+
+    //least queued, ties are broken by passenger number
+    long best = -1;
+    for (long j = 0; j < nships; j++)
+    {
+        long k = (i + j) % nships;
+        if (__atomic_load_n(&fleet[k].ended, __ATOMIC_SEQ_CST))
+            continue;
+        if (best == -1 || fleet[k].queued < fleet[best].queued)
+            best = k;
+    }
+
+    return best;
+}
+
+
+void fleet_report(const long ship_cap, const double time)
+{
+    long total = 0;
+    for (long k = 0; k < nships; k++)
+        total += fleet[k].boardings;
+
+    printf("Fleet: %ld ships, balance %s: %ld boardings in %.3lf s, "
+           "%.0lf boardings/s, %.0lf per ship\n",
+           nships, (balance == TWO) ? "two" : "least", total, time,
+           total / time, total / time / nships);
+    for (long k = 0; k < nships; k++)
+    {
+        long seats = fleet[k].cruises * ship_cap;
+        printf("Fleet: ship %2ld: %ld cruises, %ld boardings, utilization %.1lf%%\n",
+               k, fleet[k].cruises, fleet[k].boardings,
+               seats ? 100.0 * fleet[k].boardings / seats : 0.0);
+    }
 }
 
 
-void end_cruise(const short ship_cap, const short ladd_cap)
+void end_cruise(const long ship_cap, const long ladd_cap)
 {
     //signal to passangers that cruise end
-    struct sembuf end = {END, 1, 0};
-    int res = semop(semid, &end, 1);
+    struct wsembuf end = {END, 1, 0};
+    int res = sem_call(&end, 1);
     ASSERT("semop", res != -1);
 
-    open_ladd(ladd_cap);
+    //ladder stays open after ship has gone, no undo
+    open_ladd(ladd_cap, 0);
+
+    //passengers with ticket which did not board before may board
+    //now and must not wait for departure
+    if (event)
+    {
+        struct wsembuf depart = {DEPART, ship_cap, 0};
+        res = sem_call(&depart, 1);
+        ASSERT("semop", res != -1);
+    }
+    else
+    {
+        struct wsembuf allow = {SLEEP, -1, 0};
+        res = sem_call(&allow, 1);
+        ASSERT("semop", res != -1);
+    }
 
     //wait when all passangers leave ship
-    struct sembuf wait = {SHIP, ship_cap, 0};
-    res = semop(semid, &wait, 1);
+    struct wsembuf wait = {SHIP, ship_cap, 0};
+    res = sem_call(&wait, 1);
     ASSERT("semop", res != -1);
 }
 
 
-void buy_ticket()
+int buy_ticket(const short nowait)
 {
-    struct sembuf ticket = {SHIP, -1, 0};
-    int res = semop(semid, &ticket, 1);
-    ASSERT("semop", res != -1);
+    struct wsembuf ticket = {SHIP, -1, (split ? 0 : SEM_UNDO) | nowait};
+    return try_call(&ticket, 1);
 }
 
 
 int check_end()
 {
-    struct sembuf check = {END, 0, IPC_NOWAIT};
-    int res = semop(semid, &check, 1);
+    struct wsembuf check = {END, 0, IPC_NOWAIT};
+    int res = sem_call(&check, 1);
     if (res == -1 && errno == EAGAIN)
         return 1;
 
@@ -246,51 +1097,739 @@ int check_end()
 }
 
 
-void go_ship()
+int go_ship(const long i, const short nowait)
 {
-    //go to ladder
-    struct sembuf ladd = {LADD, -1, 0};
-    int res = semop(semid, &ladd, 1);
-    ASSERT("semop", res != -1);
+    if (split)
+    {
+        //go to ladder
+        struct wsembuf ladd = {LADD, -1, nowait};
+        if (try_call(&ladd, 1) == -1)
+            return -1;
+        log_mark(i, EV_LADD_ON);
 
-    //go to ship
-    struct sembuf ship = {LADD, 1, 0};
-    res = semop(semid, &ship, 1);
-    ASSERT("semop", res != -1);
+        //go to ship
+        struct event ev = log_stamp(i, EV_LADD_OFF);
+        struct wsembuf ship = {LADD, 1, 0};
+        int res = sem_call(&ship, 1);
+        ASSERT("semop", res != -1);
+        log_put(ev);
+        log_mark(i, EV_BOARD);
+
+        if (event)
+        {
+            struct wsembuf board = {BOARD, 1, 0};
+            res = sem_call(&board, 1);
+            ASSERT("semop", res != -1);
+        }
+        return 0;
+    }
+
+    //go through the ladder to the ship
+    struct wsembuf go[3] = {{LADD, -1, SEM_UNDO | nowait}, {LADD, 1, SEM_UNDO}, {BOARD, 1, 0}};
+    if (try_call(go, event ? 3 : 2) == -1)
+        return -1;
+
+    log_mark(i, EV_BOARD);
+    return 0;
 }
 
 
 void return_ticket()
 {
-    struct sembuf ret = {SHIP, 1, 0};
-    int res = semop(semid, &ret, 1);
+    struct wsembuf ret = {SHIP, 1, split ? 0 : SEM_UNDO};
+    int res = sem_call(&ret, 1);
     ASSERT("semop", res != -1);
 }
 
 
-void enjoy()
+int enjoy(const short nowait)
 {
-    struct sembuf waiting = {SLEEP, 0, 0};
-    int res = semop(semid, &waiting, 1);
-    ASSERT("semop", res != -1);
+    struct wsembuf waiting = {SLEEP, 0, nowait};
+    struct wsembuf depart = {DEPART, -1, nowait};
+    return try_call(event ? &depart : &waiting, 1);
 }
 
 
-void leave_ship()
+int leave_ship(const long i, const short nowait)
 {
-    //go to ladder
-    struct sembuf ladd = {LADD, -1, 0};
-    int res = semop(semid, &ladd, 1);
-    ASSERT("semop", res != -1);
+    if (split)
+    {
+        //go to ladder
+        struct wsembuf ladd = {LADD, -1, nowait};
+        if (try_call(&ladd, 1) == -1)
+            return -1;
+        log_mark(i, EV_LADD_ON);
 
-    //free seat on the ship
-    struct sembuf leave = {SHIP, 1, 0};
-    res = semop(semid, &leave, 1);
-    ASSERT("semop", res != -1);
-    
-    //go to beach
-    struct sembuf beach = {LADD, 1, 0};
-    res = semop(semid, &beach, 1);
-    ASSERT("semop", res != -1);
+        //free seat on the ship
+        struct event ev = log_stamp(i, EV_LEAVE);
+        struct wsembuf leave = {SHIP, 1, 0};
+        int res = sem_call(&leave, 1);
+        ASSERT("semop", res != -1);
+        log_put(ev);
+
+        //go to beach
+        ev = log_stamp(i, EV_LADD_OFF);
+        struct wsembuf beach = {LADD, 1, 0};
+        res = sem_call(&beach, 1);
+        ASSERT("semop", res != -1);
+        log_put(ev);
+        return 0;
+    }
+
+    //go through the ladder to the beach and free seat on the ship
+    struct event ev = log_stamp(i, EV_LEAVE);
+    struct wsembuf leave[3] = {{LADD, -1, SEM_UNDO | nowait}, {SHIP, 1, SEM_UNDO},
+                               {LADD, 1, SEM_UNDO}};
+    if (try_call(leave, 3) == -1)
+        return -1;
+
+    log_put(ev);
+    return 0;
+}
+
+
+/*  Event log, see struct event_log
+*/
+void log_init(const long npass, const long nfloat)
+{
+    //every boarding is 9 events at most, one more cruise is at the end
+    //of every ship, and ticket is bought and returned at every ended ship
+    evlog.slot = 9 * nships * (nfloat + 2) + 3 * nships;
+    evlog.nslots = npass + nships;
+
+    evlog.seq = (long*) mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT("mmap", evlog.seq != MAP_FAILED);
+
+    evlog.nevents = (long*) mmap(NULL, evlog.nslots * sizeof(long), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT("mmap", evlog.nevents != MAP_FAILED);
+
+    //only the used part of slots is touched
+    evlog.events = (struct event*) mmap(NULL, evlog.nslots * evlog.slot * sizeof(struct event),
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT("mmap", evlog.events != MAP_FAILED);
+}
+
+
+/*  Current process or thread writes events of npass passengers
+    starting from first
+*/
+void log_writer(const long first, const long npass)
+{
+    log_first = first;
+    log_cap = npass * evlog.slot;
+}
+
+
+struct event log_stamp(const long who, const int type)
+{
+    struct event ev = {0, 0, (int) who, (short) type, (short) (sem_base / NSEMS)};
+    if (!logging)
+        return ev;
+
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ev.seq = __atomic_fetch_add(evlog.seq, 1, __ATOMIC_SEQ_CST);
+    ev.tm = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    return ev;
+}
+
+
+void log_put(const struct event ev)
+{
+    if (!logging)
+        return;
+
+    long n = evlog.nevents[log_first];
+    ASSERT("event log overflow", n < log_cap);
+
+    evlog.events[log_first * evlog.slot + n] = ev;
+    evlog.nevents[log_first] = n + 1;
+}
+
+
+void log_mark(const long who, const int type)
+{
+    log_put(log_stamp(who, type));
+}
+
+
+/*  Merges slots, replays loads of ship and ladder in the order
+    of events and reports how long passengers wait. Returns 0 if
+    invariants are broken
+*/
+int log_check(const long npass, const long ship_cap, const long ladd_cap)
+{
+    long total = 0;
+    for (long i = 0; i < evlog.nslots; i++)
+        total += evlog.nevents[i];
+
+    struct event* all = (struct event*) malloc(total * sizeof(struct event));
+    ASSERT("malloc", all || !total);
+
+    long n = 0;
+    for (long i = 0; i < evlog.nslots; i++)
+    {
+        memcpy(all + n, evlog.events + i * evlog.slot, evlog.nevents[i] * sizeof(struct event));
+        n += evlog.nevents[i];
+    }
+    qsort(all, total, sizeof(struct event), cmp_seq);
+
+    //waits for ticket, boarding, on ship and for leaving
+    enum {W_TICKET = 0, W_BOARD, W_SAIL, W_LEAVE, NWAITS};
+    static const int wait_end[NWAITS] = {EV_TICKET, EV_BOARD, EV_DEPART, EV_LEAVE};
+    long nwait[NWAITS] = {0};
+    for (long k = 0; k < total; k++)
+    {
+        for (int w = 0; w < NWAITS; w++)
+            nwait[w] += (all[k].type == wait_end[w]);
+    }
+
+    long* waits[NWAITS];
+    for (int w = 0; w < NWAITS; w++)
+    {
+        waits[w] = (long*) malloc((nwait[w] + 1) * sizeof(long));
+        ASSERT("malloc", waits[w]);
+        nwait[w] = 0;
+    }
+    long* since = (long*) calloc(npass, sizeof(long));      //last event of passenger
+    long* waited = (long*) calloc(npass, sizeof(long));     //for ticket and boarding
+    ASSERT("calloc", since && waited);
+
+    //loads of every ship
+    long* ship_load = (long*) calloc(nships, sizeof(long));
+    long* ladd_load = (long*) calloc(nships, sizeof(long));
+    int*  open = (int*) calloc(nships, sizeof(int));
+    ASSERT("calloc", ship_load && ladd_load && open);
+
+    long ship_max = 0, ladd_max = 0;
+    long nclosed = 0;       //ladder used while closed
+
+    for (long k = 0; k < total; k++)
+    {
+        const struct event* ev = all + k;
+        const int j = ev->ship;
+        switch (ev->type)
+        {
+            case EV_OPEN:
+                open[j] = 1;
+                break;
+            case EV_CLOSE:
+                open[j] = 0;
+                break;
+            case EV_LADD_ON:
+                ladd_load[j]++;
+                nclosed += !open[j];
+                break;
+            case EV_LADD_OFF:
+                ladd_load[j]--;
+                nclosed += !open[j];
+                break;
+            case EV_BOARD:
+                ship_load[j]++;
+                break;
+            case EV_LEAVE:
+                ship_load[j]--;
+                break;
+        }
+        if (ship_load[j] > ship_max)
+            ship_max = ship_load[j];
+        if (ladd_load[j] > ladd_max)
+            ladd_max = ladd_load[j];
+
+        if (ev->who < 0 || ev->type == EV_LADD_ON || ev->type == EV_LADD_OFF)
+            continue;
+
+        for (int w = 0; w < NWAITS; w++)
+        {
+            if (ev->type != wait_end[w])
+                continue;
+
+            long dt = ev->tm - since[ev->who];
+            waits[w][nwait[w]++] = dt;
+            if (w == W_TICKET || w == W_BOARD)
+                waited[ev->who] += dt;
+        }
+        since[ev->who] = ev->tm;
+    }
+
+    int ok = ship_max <= ship_cap && ladd_max <= ladd_cap && !nclosed;
+    printf("Log: %ld events of %ld passengers\n", total, npass);
+    printf("Check: ship load max %ld of %ld, ladder load max %ld of %ld%s, "
+           "ladder used while closed %ld times: %s\n",
+           ship_max, ship_cap, ladd_max, ladd_cap, split ? "" : " (atomic, not seen)",
+           nclosed, ok ? "OK" : "FAILED");
+
+    printf("Wait, ms:       mean      p50      p90      p99      max\n");
+    wait_report("ticket", waits[W_TICKET], nwait[W_TICKET]);
+    wait_report("boarding", waits[W_BOARD], nwait[W_BOARD]);
+    wait_report("on ship", waits[W_SAIL], nwait[W_SAIL]);
+    wait_report("leaving", waits[W_LEAVE], nwait[W_LEAVE]);
+    wait_report("passenger", waited, npass);
+
+    for (int w = 0; w < NWAITS; w++)
+        free(waits[w]);
+    free(open);
+    free(ladd_load);
+    free(ship_load);
+    free(waited);
+    free(since);
+    free(all);
+
+    return ok;
 }
 
+
+/*  Sorts waits, ns, and prints their distribution
+*/
+void wait_report(const char* name, long* waits, const long n)
+{
+    if (!n)
+    {
+        printf("  %-10s      -\n", name);
+        return;
+    }
+
+    qsort(waits, n, sizeof(long), cmp_long);
+
+    double sum = 0;
+    for (long k = 0; k < n; k++)
+        sum += waits[k];
+
+    printf("  %-10s %8.3lf %8.3lf %8.3lf %8.3lf %8.3lf\n", name, sum / n / 1e6,
+           waits[n / 2] / 1e6, waits[n * 9 / 10] / 1e6, waits[n * 99 / 100] / 1e6,
+           waits[n - 1] / 1e6);
+}
+
+
+int cmp_seq(const void* a, const void* b)
+{
+    long x = ((const struct event*) a)->seq;
+    long y = ((const struct event*) b)->seq;
+    return (x > y) - (x < y);
+}
+
+
+int cmp_long(const void* a, const void* b)
+{
+    long x = *(const long*) a;
+    long y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+
+void log_clear()
+{
+    munmap(evlog.events, evlog.nslots * evlog.slot * sizeof(struct event));
+    munmap(evlog.nevents, evlog.nslots * sizeof(long));
+    munmap(evlog.seq, sizeof(long));
+}
+
+
+/*  Resource manager. Objects which outlive processes are registered
+    and removed by the process which created them: on exit, including
+    ASSERT, and on fatal signals. Forked passengers and ships inherit
+    the handlers but are not owners, so they never remove anything
+*/
+void res_register(const char* name, const int id, int (*release)(const int id))
+{
+    ASSERT("too many resources", nresources < NRESOURCES);
+
+    if (!res_owner)
+    {
+        res_owner = getpid();
+        atexit(res_release_all);
+
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = res_signal;
+        act.sa_flags = SA_RESETHAND;
+        sigemptyset(&act.sa_mask);
+
+        const int sigs[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGABRT, SIGSEGV, SIGBUS};
+        for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+            sigaction(sigs[i], &act, NULL);
+    }
+
+    resources[nresources].name = name;
+    resources[nresources].id = id;
+    resources[nresources].release = release;
+    nresources++;
+}
+
+
+/*  Releases resource id and forgets it
+*/
+int res_release(const int id)
+{
+    for (int i = 0; i < nresources; i++)
+    {
+        if (resources[i].id == id)
+        {
+            int res = resources[i].release(id);
+            res_forget(id);
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+
+/*  Resource id is not released any more, it is left for others
+*/
+void res_forget(const int id)
+{
+    for (int i = 0; i < nresources; i++)
+    {
+        if (resources[i].id == id)
+        {
+            resources[i] = resources[--nresources];
+            return;
+        }
+    }
+}
+
+
+/*  Async-signal-safe, only syscalls are made
+*/
+void res_release_all()
+{
+    if (getpid() != res_owner)
+        return;
+
+    while (nresources > 0)
+    {
+        nresources--;
+        resources[nresources].release(resources[nresources].id);
+    }
+}
+
+
+void res_signal(int sig)
+{
+    res_release_all();
+    raise(sig);
+}
+
+
+int sem_remove(const int id)
+{
+    return semctl(id, 0, IPC_RMID, 0);
+}
+
+
+/*  System V semaphores: every call is one atomic semop.
+
+    Without key file the set is private and removed on exit. With key
+    file the set is named by ftok of the file, stays after a clean exit
+    and the next run reuses it as it is. Two more semaphores at the end
+    of the set keep its state: sem[nsems] is the lock, taken with
+    SEM_UNDO so the kernel frees it when the run dies, sem[nsems + 1]
+    is 1 only after a clean exit, which also zeroes the set. So reuse
+    is one semop, and a set left by a crashed run is removed, which
+    wakes orphaned processes with EIDRM, and made again
+*/
+void sysv_init(const int nsems)
+{
+    double start = get_time();
+
+    if (!keyfile)
+    {
+        semid = semget(IPC_PRIVATE, nsems, 0700);
+        ASSERT("semget", semid != -1);
+        res_register("semaphore set", semid, sem_remove);
+        ipc_setup = "created";
+        ipc_time = get_time() - start;
+        return;
+    }
+
+    const unsigned short lock = nsems;
+    const unsigned short clean = nsems + 1;
+    nsysv = nsems + 2;
+
+    key_t key = ftok(keyfile, 'S');
+    if (key == -1 && errno == ENOENT)
+    {
+        int fd = open(keyfile, O_RDONLY | O_CREAT, 0600);
+        ASSERT("open key file", fd != -1);
+        close(fd);
+        key = ftok(keyfile, 'S');
+    }
+    ASSERT("ftok", key != -1);
+
+    //take free lock and clean mark at once
+    struct sembuf take[3] = {{lock, 0, IPC_NOWAIT}, {lock, 1, SEM_UNDO},
+                             {clean, -1, IPC_NOWAIT}};
+
+    //existing set is looked up first, it is the common case
+    ipc_setup = "created";
+    long backoff = 1;
+    for (;;)
+    {
+        semid = semget(key, 0, 0);
+        if (semid != -1)
+        {
+            struct semid_ds ds;
+            union semun arg = {.buf = &ds};
+            int res = semctl(semid, 0, IPC_STAT, arg);
+            const int fits = res != -1 && (int) ds.sem_nsems == nsysv;
+
+            if (fits && semop(semid, take, 3) == 0)
+            {
+                ipc_setup = "reused";
+                break;
+            }
+
+            //set made by another run is not locked before its first semop
+            if (fits && ds.sem_otime == 0)
+            {
+                usleep(backoff);
+                if (backoff < BACKOFF_MAX)
+                    backoff *= 2;
+                continue;
+            }
+
+            if (fits && semctl(semid, lock, GETVAL) > 0)
+            {
+                fprintf(stderr, "%s: key file %s is used by process %d\n",
+                        progname, keyfile, semctl(semid, lock, GETPID));
+                exit(EXIT_FAILURE);
+            }
+
+            //another run may reclaim it at the same time
+            if (semctl(semid, 0, IPC_RMID, 0) == -1 && errno != EINVAL && errno != EIDRM)
+                ASSERT("semctl", 0);
+            ipc_setup = "reclaimed";
+        }
+
+        //the run which makes the set first takes it, others look it up again
+        semid = semget(key, nsysv, IPC_CREAT | IPC_EXCL | 0600);
+        if (semid == -1 && errno == EEXIST)
+            continue;
+        ASSERT("semget", semid != -1);
+
+        int res = semop(semid, take, 2);
+        ASSERT("semop", res != -1);
+        break;
+    }
+
+    //removed if the run crashes, kept on clean exit
+    res_register("semaphore set", semid, sem_remove);
+    ipc_time = get_time() - start;
+}
+
+
+int sysv_op(struct wsembuf* ops, size_t nops)
+{
+    struct sembuf sops[NOPS_MAX];
+    for (size_t i = 0; i < nops; i++)
+    {
+        sops[i].sem_num = ops[i].sem_num;
+        sops[i].sem_op  = (short) ops[i].sem_op;
+        sops[i].sem_flg = ops[i].sem_flg;
+    }
+
+    return semop(semid, sops, nops);
+}
+
+
+void sysv_clear()
+{
+    if (keyfile)
+    {
+        /*  named set stays for the next run zeroed, unlocked and marked
+            clean, SETALL also drops undo of the lock
+        */
+        res_forget(semid);
+        unsigned short vals[nsysv];
+        memset(vals, 0, sizeof(vals));
+        vals[nsysv - 1] = 1;
+        union semun arg = {.array = vals};
+        int res = semctl(semid, 0, SETALL, arg);
+        ASSERT("semctl", res != -1);
+        return;
+    }
+
+    int ctl = res_release(semid);
+    ASSERT("semctl", ctl != -1);
+}
+
+
+/*  Counting semaphores on atomics in shared memory: the value is
+    changed with CAS and the kernel is entered through futex only
+    to sleep or to wake sleepers. Operations of one call are applied
+    in order, not atomically
+*/
+void futex_init(const int nsems)
+{
+    fsems = (struct fsem*) mmap(NULL, nsems * sizeof(struct fsem), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT("mmap", fsems != MAP_FAILED);
+    nfsems = nsems;
+}
+
+
+/*  Wake waiters after n was added to sem
+*/
+void futex_wake(struct fsem* sem, int n)
+{
+    if (__atomic_load_n(&sem->big_waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &sem->val, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    else if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &sem->val, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+
+int futex_wait(int* addr, int* waiters, int val)
+{
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    int res = syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+    if (res == -1 && errno != EAGAIN && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+
+int futex_op(struct wsembuf* ops, size_t nops)
+{
+    for (size_t i = 0; i < nops; i++)
+    {
+        struct fsem* sem = fsems + ops[i].sem_num;
+        int op = ops[i].sem_op;
+
+        if (op > 0)
+        {
+            __atomic_add_fetch(&sem->val, op, __ATOMIC_SEQ_CST);
+            futex_wake(sem, op);
+            continue;
+        }
+
+        while (1)
+        {
+            int zseq = __atomic_load_n(&sem->zseq, __ATOMIC_SEQ_CST);
+            int val = __atomic_load_n(&sem->val, __ATOMIC_SEQ_CST);
+            if (op == 0 && val == 0)
+                break;
+
+            if (op < 0 && val >= -op)
+            {
+                if (__atomic_compare_exchange_n(&sem->val, &val, val + op, 0,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                {
+                    if (val + op == 0)
+                    {
+                        __atomic_add_fetch(&sem->zseq, 1, __ATOMIC_SEQ_CST);
+                        if (__atomic_load_n(&sem->zwaiters, __ATOMIC_SEQ_CST))
+                            syscall(SYS_futex, &sem->zseq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+                    }
+                    break;
+                }
+                continue;
+            }
+
+            if (ops[i].sem_flg & IPC_NOWAIT)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            int res = 0;
+            if (op == 0)
+                res = futex_wait(&sem->zseq, &sem->zwaiters, zseq);
+            else
+                res = futex_wait(&sem->val, (op == -1) ? &sem->waiters : &sem->big_waiters, val);
+            if (res == -1)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+void futex_clear()
+{
+    int res = munmap(fsems, nfsems * sizeof(struct fsem));
+    ASSERT("munmap", res != -1);
+}
+
+
+/*  POSIX unnamed semaphores in shared memory: sem_op is done by
+    |sem_op| waits or posts, waiting for zero is polling with backoff
+*/
+void posix_init(const int nsems)
+{
+    psems = (sem_t*) mmap(NULL, nsems * sizeof(sem_t), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT("mmap", psems != MAP_FAILED);
+    nfsems = nsems;
+
+    for (int i = 0; i < nsems; i++)
+    {
+        int res = sem_init(psems + i, 1, 0);
+        ASSERT("sem_init", res != -1);
+    }
+}
+
+
+int posix_op(struct wsembuf* ops, size_t nops)
+{
+    for (size_t i = 0; i < nops; i++)
+    {
+        sem_t* sem = psems + ops[i].sem_num;
+        int op = ops[i].sem_op;
+
+        for (int j = 0; j < op; j++)
+            if (sem_post(sem) == -1)
+                return -1;
+
+        for (int j = 0; j < -op; j++)
+        {
+            int res = (ops[i].sem_flg & IPC_NOWAIT) ? sem_trywait(sem) : sem_wait(sem);
+            if (res == -1 && errno == EINTR)
+                j--;
+            else if (res == -1)
+            {
+                //give back what was taken
+                while (j-- > 0)
+                    sem_post(sem);
+                return -1;
+            }
+        }
+
+        if (op == 0)
+        {
+            useconds_t backoff = 1;
+            int val = 0;
+            while (sem_getvalue(sem, &val) == 0 && val > 0)
+            {
+                if (ops[i].sem_flg & IPC_NOWAIT)
+                {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                usleep(backoff);
+                if (backoff < BACKOFF_MAX)
+                    backoff *= 2;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+void posix_clear()
+{
+    for (int i = 0; i < nfsems; i++)
+        sem_destroy(psems + i);
+
+    int res = munmap(psems, nfsems * sizeof(sem_t));
+    ASSERT("munmap", res != -1);
+}
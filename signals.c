@@ -4,8 +4,20 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define X86
+#endif
 
 
 #define error_check(MSG, res)                \
@@ -20,9 +32,41 @@ do{                                          \
 
 enum
 {
-    BUF_SIZE = 256,
+    BUF_SIZE   = 256,
+    WORD       = sizeof(union sigval),      // bytes in one realtime signal
+    PAYLOAD    = WORD - 1,                  // data bytes of a word
+    WINDOW     = 64,                        // words sent and not acked
+    WINDOW_MAX = 4096,
+    SIG_BATCH  = 64,                        // signals taken by one read
+    OUT_SIZE   = 1 << 16,                   // output kept before write
+    FLUSH_MS   = 10,                        // output waits when idle
+    FRAME_MAX  = 4096,                      // payload of one frame
+    FRAME_HEAD = 3,                         // length and flags
+    CRC_SIZE   = 4,
+    RING_SIZE  = 1 << 20,                   // shared memory ring
+    READERS_MAX = 64,
 };
 
+/*  Both modes carry a stream of frames: 16-bit length, flags, payload
+    and CRC32C of the payload if FRAME_CRC is set. An empty frame with
+    FRAME_END ends the stream, so any byte may be in the data
+*/
+enum
+{
+    FRAME_CRC = 1,
+    FRAME_END = 2,
+};
+
+/*  Realtime mode: SIG_DATA carries a word in sigval, its last byte is
+    the sequence number. SIG_LAST carries the tail bytes with their number
+    in the last byte and SIG_ACK gives back the number of words received.
+    Queued realtime signals of lower numbers come first, so the tail
+    comes after all the data
+*/
+#define SIG_DATA (SIGRTMIN)
+#define SIG_LAST (SIGRTMIN + 1)
+#define SIG_ACK  (SIGRTMIN + 2)
+
 char* progname;
 
 pid_t rpid = -1;
@@ -34,6 +78,93 @@ int wait_bit = 1;
 int bit = 0;
 
 sigset_t oldmask;
+sigset_t blocked;   // all signals of the protocol
+
+//synchronous mode, signals are read from signalfd and output is batched
+int sfd = -1;
+int efd = -1;
+struct signalfd_siginfo infos[SIG_BATCH];
+int ninfos = 0;
+int iinfo = 0;
+char out[OUT_SIZE];
+int nout = 0;
+
+int realtime = 0;
+int crc = 0;        // frames of reader have CRC
+
+typedef uint32_t (*crc_t)(uint32_t, const unsigned char*, int);
+crc_t crc32c = NULL;
+uint32_t crc_table[256];
+
+//frame being received by writer
+struct frame
+{
+    unsigned char head[FRAME_HEAD];
+    int           nhead;
+    int           need;         // payload and CRC bytes
+    unsigned char data[FRAME_MAX + CRC_SIZE];
+    int           ndata;
+    long          count;
+};
+
+/*  Writer side of a reader, realtime signals are told apart by si_pid.
+    Frames of a channel are written in order, frames of different
+    channels go as they are completed
+*/
+struct channel
+{
+    pid_t        pid;
+    struct frame frame;
+    unsigned     nrecv;
+    int          ack_due;   // ack did not fit to the signal queue
+    int          done;
+};
+struct channel* channels = NULL;
+int nchannels = 1;
+int ndone = 0;
+int lines = 0;              // readers end frames at new lines
+
+int window = WINDOW;
+char pending[PAYLOAD];                  // reader bytes not sent in a word
+int npending = 0;
+unsigned sent = 0;
+int ack_every = 0;                      // words received per ack
+unsigned acked = 0;                     // words the writer has got
+union sigval* words = NULL;             // taken by handler, not written
+int* word_sigs = NULL;
+pid_t* word_pids = NULL;
+int nwords = 0;
+
+//syscalls of this process for --stats
+struct stats
+{
+    long bytes;
+    long signals;
+    long waits;
+    long reads;
+    long writes;
+    long retries;   // signal queue was full
+};
+struct stats stats;
+
+/*  Shared memory mode: reader reads stdin right into the ring and
+    writer writes from it, signals only wake the side which sleeps.
+    A side sets its sleep flag before the last check, the other one
+    rings only if it takes the flag, so one signal covers all the
+    chunks put while the side was going to sleep
+*/
+#define HOT __attribute__((aligned(64)))
+
+struct shm
+{
+    HOT unsigned long head;     // bytes put by reader
+    HOT unsigned long tail;     // bytes written out by writer
+    HOT int writer_sleep;
+    int     reader_sleep;
+    int     done;               // reader got end of stdin
+    HOT char data[RING_SIZE];
+};
+struct shm* shm = NULL;
 
 
 void reader();
@@ -48,29 +179,218 @@ void handler_rd(int sig);
 void send_byte(char byte);
 char recv_byte();
 
+void send_frame(const char* data, int n, int flags);
+void send_bytes(const char* data, int n);
+int  frame_take(struct frame* frame, const char* data, int n);
+int  frame_done(struct frame* frame);
+void crc_init();
+uint32_t crc32c_table(uint32_t crc, const unsigned char* p, int n);
+#ifdef X86
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, int n);
+#endif
+
+void init_rt_reader();
+void rt_put(const char* data, int n);
+void rt_writer();
+void rt_send(int sig, const char* data, int n, int tag);
+void rt_wait_ack();
+int  rt_take(int sig, pid_t pid, union sigval word);
+void rt_ack(struct channel* ch);
+int  rt_acks();
+struct channel* channel_of(pid_t pid);
+void handler_data(int sig, siginfo_t* info, void* ctx);
+void handler_ack(int sig, siginfo_t* info, void* ctx);
+void stats_report(const char* who);
+
+void shm_reader();
+void shm_writer();
+void shm_ring(int* sleep, pid_t pid, int sig);
+void shm_wait(int* sleep);
+
+void block_signals();
+void init_sync();
+int  next_sig(struct signalfd_siginfo* info);
+void out_put(const void* data, int n);
+void out_flush();
+
 
 int main(int argc, char* argv[])
 {
     progname = argv[0];
-    if (argc != 1)
+
+    struct option longopts[] = {
+        {"realtime", no_argument, NULL, 'r'},
+        {"window", required_argument, NULL, 'w'},
+        {"signalfd", no_argument, NULL, 's'},
+        {"ack", required_argument, NULL, 'a'},
+        {"stats", no_argument, NULL, 'S'},
+        {"crc", no_argument, NULL, 'c'},
+        {"shm", no_argument, NULL, 'm'},
+        {0, 0, 0, 0}
+    };
+
+    int sync = 0;
+    int stat = 0;
+    int shared = 0;
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, "rw:sa:Scm", longopts, NULL)) != -1)
     {
-        printf("%s: arguments are not expected\n",
-               progname);
+        switch (ch)
+        {
+            case 'r':
+                realtime = 1;
+                break;
+            case 's':
+                sync = 1;
+                break;
+            case 'S':
+                stat = 1;
+                break;
+            case 'c':
+                crc = 1;
+                break;
+            case 'm':
+                shared = 1;
+                break;
+            case 'w':
+            {
+                char* end = NULL;
+                errno = 0;
+                long val = strtol(optarg, &end, 0);
+                if (errno || *end || val <= 0 || val > WINDOW_MAX)
+                {
+                    printf("%s: window must be from 1 to %d\n", progname, WINDOW_MAX);
+                    return 0;
+                }
+                window = val;
+                break;
+            }
+            case 'a':
+            {
+                char* end = NULL;
+                errno = 0;
+                long val = strtol(optarg, &end, 0);
+                if (errno || *end || val <= 0 || val > WINDOW_MAX)
+                {
+                    printf("%s: ack must be from 1 to %d\n", progname, WINDOW_MAX);
+                    return 0;
+                }
+                ack_every = val;
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+
+    //every input file gets a reader, stdin is read if there are none
+    int nfiles = argc - optind;
+    if (nfiles > READERS_MAX)
+    {
+        printf("%s: more than %d inputs\n", progname, READERS_MAX);
         return 0;
     }
+    if (nfiles > 1 && (!realtime || shared))
+    {
+        printf("%s: several inputs need --realtime\n", progname);
+        return 0;
+    }
+    nchannels = nfiles ? nfiles : 1;
+    lines = nchannels > 1;
+
+    //writer acks before reader fills the window
+    if (!ack_every)
+        ack_every = (window + 1) / 2;
+    if (ack_every > window)
+    {
+        printf("%s: ack %d is more than window %d\n", progname, ack_every, window);
+        return 0;
+    }
+
+    crc_init();
 
     wpid = getpid();
     error_check("getpid", wpid);
 
-    rpid = fork();
-    error_check("fork", rpid);
+    //signals sent before the other side sets handlers stay pending
+    block_signals();
+
+    if (shared)
+    {
+        shm = (struct shm*) mmap(NULL, sizeof(struct shm), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shm == MAP_FAILED)
+            error_check("mmap", -1);
+    }
+
+    channels = (struct channel*) calloc(nchannels, sizeof(struct channel));
+    words = (union sigval*) calloc(nchannels * (window + 1), sizeof(union sigval));
+    word_sigs = (int*) calloc(nchannels * (window + 1), sizeof(int));
+    word_pids = (pid_t*) calloc(nchannels * (window + 1), sizeof(pid_t));
+    if (!channels || !words || !word_sigs || !word_pids)
+        error_check("calloc", -1);
+
+    //writer would wait forever for a reader which cannot open its file
+    int fds[READERS_MAX];
+    for (int i = 0; i < nchannels; i++)
+    {
+        fds[i] = STDIN_FILENO;
+        if (nfiles)
+        {
+            fds[i] = open(argv[optind + i], O_RDONLY);
+            if (fds[i] == -1)
+            {
+                fprintf(stderr, "%s: %s: %s\n", progname, argv[optind + i], strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for (int i = 0; i < nchannels; i++)
+    {
+        int fd = fds[i];
+        pid_t pid = fork();
+        error_check("fork", pid);
+
+        if (pid == 0)
+        {
+            if (fd != STDIN_FILENO)
+            {
+                int res = dup2(fd, STDIN_FILENO);
+                error_check("dup2", res);
+                close(fd);
+            }
+            if (sync)
+                init_sync();
+
+            shm ? shm_reader() : reader();
+            if (stat)
+                stats_report("reader");
+            exit(EXIT_SUCCESS);
+        }
+        channels[i].pid = pid;
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    rpid = channels[0].pid;
+
+    if (sync)
+        init_sync();
 
-    if (rpid == 0)
-        reader();
+    if (shm)
+        shm_writer();
     else
-        writer();
+        realtime ? rt_writer() : writer();
+    if (stat)
+    {
+        stats_report("writer");
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_SIGPENDING, &rl) != -1)
+            fprintf(stderr, "%d readers, signal queue limit %ld\n",
+                    nchannels, (long) rl.rlim_cur);
+    }
 
-    wait(NULL);
+    while (wait(NULL) > 0);
 
     return 0;
 }
@@ -78,38 +398,211 @@ int main(int argc, char* argv[])
 
 void writer()
 {
-    init_writer();
-    int res = -1;
-    char byte = -1;
+    if (sfd == -1)
+        init_writer();
+    char byte = 0;
 
-    while ((byte = recv_byte()) != EOF)
-    {
-        res = write(STDOUT_FILENO, &byte, 1);
-        error_check("write", res);
-    }
+    do
+        byte = recv_byte();
+    while (frame_take(&channels[0].frame, &byte, 1));
 }
 
 
+/*  Sends stdin a frame per read and the end frame after it. With several
+    readers frames end at the last new line so that lines are not mixed,
+    and a last line without one gets it
+*/
 void reader()
 {
-    init_reader();
+    if (realtime)
+        init_rt_reader();
+    else if (sfd == -1)
+        init_reader();
     int read_res = 0;
-    char buf[BUF_SIZE + 1];
+    char buf[FRAME_MAX];
+    int have = 0;
 
-    while ((read_res = read(STDIN_FILENO, buf, BUF_SIZE)))
+    while ((read_res = read(STDIN_FILENO, buf + have, FRAME_MAX - have)))
     {
         error_check("read", read_res);
-        for (int i = 0; i < read_res; i++)
+        stats.reads++;
+        stats.bytes += read_res;
+        have += read_res;
+
+        int n = have;
+        if (lines)
+        {
+            while (n > 0 && buf[n - 1] != '\n')
+                n--;
+            if (!n && have == FRAME_MAX)
+                n = have;
+        }
+        if (!n)
+            continue;
+
+        send_frame(buf, n, 0);
+        have -= n;
+        memmove(buf, buf + n, have);
+    }
+    //a last line without new line would be glued to a line of another reader
+    if (have && lines)
+        buf[have++] = '\n';
+    if (have)
+        send_frame(buf, have, 0);
+    send_frame(buf, 0, FRAME_END);
+
+    //the tail of the last word tells writer how many bytes it has
+    if (realtime)
+        rt_send(SIG_LAST, pending, npending, npending);
+}
+
+
+void send_frame(const char* data, int n, int flags)
+{
+    unsigned char head[FRAME_HEAD] = {n & 0xFF, n >> 8, flags | (crc ? FRAME_CRC : 0)};
+    send_bytes((char*) head, FRAME_HEAD);
+    send_bytes(data, n);
+
+    if (crc)
+    {
+        uint32_t sum = crc32c(0, (const unsigned char*) data, n);
+        unsigned char tail[CRC_SIZE] = {sum, sum >> 8, sum >> 16, sum >> 24};
+        send_bytes((char*) tail, CRC_SIZE);
+    }
+}
+
+
+void send_bytes(const char* data, int n)
+{
+    if (realtime)
+        rt_put(data, n);
+    else
+        for (int i = 0; i < n; i++)
+            send_byte(data[i]);
+}
+
+
+/*  Feeds received bytes to the frame, returns 0 after the end frame
+*/
+int frame_take(struct frame* frame, const char* data, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (frame->nhead < FRAME_HEAD)
         {
-            send_byte(buf[i]);
+            frame->head[frame->nhead++] = data[i];
+            if (frame->nhead < FRAME_HEAD)
+                continue;
+
+            int len = frame->head[0] | frame->head[1] << 8;
+            if (len > FRAME_MAX)
+            {
+                fprintf(stderr, "%s: frame %ld: length %d\n", progname, frame->count, len);
+                exit(EXIT_FAILURE);
+            }
+            frame->need = len + (frame->head[2] & FRAME_CRC ? CRC_SIZE : 0);
         }
+        else
+            frame->data[frame->ndata++] = data[i];
+
+        if (frame->ndata == frame->need && !frame_done(frame))
+            return 0;
     }
-    send_byte(EOF);
 
-    exit(EXIT_SUCCESS);
+    return 1;
 }
 
 
+/*  Checks and writes out the whole frame, returns 0 for the end frame
+*/
+int frame_done(struct frame* frame)
+{
+    int len = frame->head[0] | frame->head[1] << 8;
+    if (frame->head[2] & FRAME_CRC)
+    {
+        const unsigned char* tail = frame->data + len;
+        uint32_t sum = tail[0] | tail[1] << 8 | tail[2] << 16 | (uint32_t) tail[3] << 24;
+        if (sum != crc32c(0, frame->data, len))
+        {
+            fprintf(stderr, "%s: frame %ld: CRC mismatch\n", progname, frame->count);
+            exit(EXIT_FAILURE);
+        }
+    }
+    out_put(frame->data, len);
+
+    int end = frame->head[2] & FRAME_END;
+    frame->nhead = 0;
+    frame->ndata = 0;
+    frame->count++;
+    if (end)
+        out_flush();
+
+    return !end;
+}
+
+
+/*  CRC32C, the instruction of SSE 4.2 if there is one
+*/
+void crc_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc_table[i] = c;
+    }
+
+    crc32c = crc32c_table;
+#ifdef X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c = crc32c_sse42;
+#endif
+}
+
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char* p, int n)
+{
+    crc = ~crc;
+    for (int i = 0; i < n; i++)
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+
+#ifdef X86
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, int n)
+{
+    int i = 0;
+#ifdef __x86_64__
+    uint64_t c = ~crc;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, p + i, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+#else
+    //_mm_crc32_u64 is x86-64 only
+    uint32_t c = ~crc;
+    for (; i + 4 <= n; i += 4)
+    {
+        uint32_t word = 0;
+        memcpy(&word, p + i, 4);
+        c = _mm_crc32_u32(c, word);
+    }
+#endif
+    for (; i < n; i++)
+        c = _mm_crc32_u8(c, p[i]);
+
+    return ~(uint32_t) c;
+}
+#endif
+
+
 void send_byte(char byte)
 {
     int res = -1;
@@ -121,12 +614,18 @@ void send_byte(char byte)
         int sig = (bit == 0) ? SIGUSR1 : SIGUSR2;
         res = kill(wpid, sig);
         error_check("rd kill", res);
+        stats.signals++;
+
+        struct signalfd_siginfo info;
+        if (sfd != -1)
+            next_sig(&info);
  
-        while (wait_ans)
+        while (sfd == -1 && wait_ans)
         {
             sigsuspend(&oldmask);
             if (errno != EINTR)
                 error_check("rd sigsuspend", -1);
+            stats.waits++;
         }
     }
 }
@@ -139,16 +638,22 @@ char recv_byte()
     for (int i = 0; i < 8; i++)
     {
         wait_bit = 1;
-        while (wait_bit)
+        struct signalfd_siginfo info;
+        if (sfd != -1)
+            bit = next_sig(&info) == SIGUSR2;
+
+        while (sfd == -1 && wait_bit)
         {
             sigsuspend(&oldmask);
             if (errno != EINTR)
                 error_check("rd sigsuspend", -1);
+            stats.waits++;
         }
         byte = byte | (bit << i);
 
         res = kill(rpid, SIGUSR1);
         error_check("wr kill", res);
+        stats.signals++;
     }
     return byte;
 }
@@ -196,7 +701,7 @@ void init_writer()
     error_check("wr sigaddset usr1", res);
     res = sigaddset(&mask, SIGUSR2);
     error_check("wr sigaddset usr2", res);
-    res = sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    res = sigprocmask(SIG_BLOCK, &mask, NULL);
     error_check("wr sigprocmask", res);
     
     struct sigaction act = {};
@@ -217,7 +722,7 @@ void init_reader()
     error_check("rd sigemptyset", res);
     res = sigaddset(&mask, SIGUSR1);
     error_check("rd sigaddset usr1", res);
-    res = sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    res = sigprocmask(SIG_BLOCK, &mask, NULL);
     error_check("rd sigprocmask", res);
     
     struct sigaction act = {};
@@ -227,3 +732,443 @@ void init_reader()
     error_check("rd sigaction usr1", res);
 }
 
+
+/*  Reads stdin to free space of the ring, at most up to its end
+*/
+void shm_reader()
+{
+    while (1)
+    {
+        unsigned long head = shm->head;
+        unsigned long tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+        if (head - tail == RING_SIZE)
+        {
+            shm_wait(&shm->reader_sleep);
+            continue;
+        }
+
+        size_t pos = head % RING_SIZE;
+        size_t room = RING_SIZE - (head - tail);
+        if (room > RING_SIZE - pos)
+            room = RING_SIZE - pos;
+
+        int read_res = read(STDIN_FILENO, shm->data + pos, room);
+        error_check("read", read_res);
+        stats.reads++;
+        if (!read_res)
+            break;
+
+        stats.bytes += read_res;
+        __atomic_store_n(&shm->head, head + read_res, __ATOMIC_SEQ_CST);
+        shm_ring(&shm->writer_sleep, wpid, SIG_DATA);
+    }
+
+    __atomic_store_n(&shm->done, 1, __ATOMIC_SEQ_CST);
+    shm_ring(&shm->writer_sleep, wpid, SIG_DATA);
+}
+
+
+void shm_writer()
+{
+    while (1)
+    {
+        unsigned long tail = shm->tail;
+        int done = __atomic_load_n(&shm->done, __ATOMIC_SEQ_CST);
+        unsigned long head = __atomic_load_n(&shm->head, __ATOMIC_SEQ_CST);
+        if (head == tail)
+        {
+            if (done)
+                break;
+            shm_wait(&shm->writer_sleep);
+            continue;
+        }
+
+        size_t pos = tail % RING_SIZE;
+        size_t n = head - tail;
+        if (n > RING_SIZE - pos)
+            n = RING_SIZE - pos;
+
+        int res = write(STDOUT_FILENO, shm->data + pos, n);
+        error_check("write", res);
+        stats.writes++;
+        stats.bytes += res;
+
+        __atomic_store_n(&shm->tail, tail + res, __ATOMIC_SEQ_CST);
+        shm_ring(&shm->reader_sleep, rpid, SIG_ACK);
+    }
+}
+
+
+/*  Wakes the other side if it said it goes to sleep
+*/
+void shm_ring(int* sleep, pid_t pid, int sig)
+{
+    if (!__atomic_load_n(sleep, __ATOMIC_SEQ_CST) ||
+        !__atomic_exchange_n(sleep, 0, __ATOMIC_SEQ_CST))
+        return;
+
+    int res = kill(pid, sig);
+    error_check("shm kill", res);
+    stats.signals++;
+}
+
+
+/*  Sleeps till the doorbell if the ring is still empty for writer or
+    full for reader after the flag is set, a late doorbell only makes
+    the next wait return at once
+*/
+void shm_wait(int* sleep)
+{
+    __atomic_store_n(sleep, 1, __ATOMIC_SEQ_CST);
+
+    unsigned long head = __atomic_load_n(&shm->head, __ATOMIC_SEQ_CST);
+    unsigned long tail = __atomic_load_n(&shm->tail, __ATOMIC_SEQ_CST);
+    int idle = sleep == &shm->writer_sleep ?
+               head == tail && !__atomic_load_n(&shm->done, __ATOMIC_SEQ_CST) :
+               head - tail == RING_SIZE;
+    if (idle)
+    {
+        int res = sigwaitinfo(&blocked, NULL);
+        if (res == -1 && errno != EINTR)
+            error_check("sigwaitinfo", res);
+        stats.waits++;
+    }
+
+    __atomic_store_n(sleep, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/*  Blocks signals of both modes, they stay pending till the handler
+    is set or are read from signalfd
+*/
+void block_signals()
+{
+    int res = sigemptyset(&blocked);
+    error_check("sigemptyset", res);
+    res = sigaddset(&blocked, SIGUSR1);
+    error_check("sigaddset usr1", res);
+    res = sigaddset(&blocked, SIGUSR2);
+    error_check("sigaddset usr2", res);
+    res = sigaddset(&blocked, SIG_DATA);
+    error_check("sigaddset data", res);
+    res = sigaddset(&blocked, SIG_LAST);
+    error_check("sigaddset last", res);
+    res = sigaddset(&blocked, SIG_ACK);
+    error_check("sigaddset ack", res);
+    res = sigprocmask(SIG_BLOCK, &blocked, &oldmask);
+    error_check("sigprocmask", res);
+}
+
+
+void init_rt_reader()
+{
+    if (sfd != -1)
+        return;
+
+    struct sigaction act = {};
+    act.sa_sigaction = handler_ack;
+    act.sa_flags = SA_SIGINFO;
+    int res = sigaction(SIG_ACK, &act, NULL);
+    error_check("rd sigaction ack", res);
+}
+
+
+/*  Packs bytes to words with sequence numbers, at most window of them
+    are not acked
+*/
+void rt_put(const char* data, int n)
+{
+    for (int i = 0; i < n; )
+    {
+        int k = PAYLOAD - npending < n - i ? PAYLOAD - npending : n - i;
+        memcpy(pending + npending, data + i, k);
+        npending += k;
+        i += k;
+        if (npending < PAYLOAD)
+            break;
+
+        while (sent - acked >= (unsigned) window)
+            rt_wait_ack();
+        rt_send(SIG_DATA, pending, PAYLOAD, sent & 0xFF);
+        sent++;
+        npending = 0;
+    }
+}
+
+
+void rt_send(int sig, const char* data, int n, int tag)
+{
+    unsigned char bytes[WORD] = {0};
+    memcpy(bytes, data, n);
+    bytes[PAYLOAD] = tag;
+
+    union sigval val;
+    memcpy(&val, bytes, WORD);
+
+    //queue of pending signals is full, writer empties it
+    while (sigqueue(wpid, sig, val) == -1)
+    {
+        if (errno != EAGAIN)
+            error_check("rd sigqueue", -1);
+        stats.retries++;
+        sched_yield();
+    }
+    stats.signals++;
+}
+
+
+void rt_wait_ack()
+{
+    if (sfd != -1)
+    {
+        struct signalfd_siginfo info;
+        next_sig(&info);
+        acked = info.ssi_int;
+        return;
+    }
+
+    sigsuspend(&oldmask);
+    if (errno != EINTR)
+        error_check("rd sigsuspend", -1);
+    stats.waits++;
+}
+
+
+/*  Words taken by handler are written out after each wakeup
+*/
+void rt_writer()
+{
+    if (sfd != -1)
+    {
+        struct signalfd_siginfo info;
+        while (1)
+        {
+            int sig = next_sig(&info);
+            union sigval word;
+            memcpy(&word, &info.ssi_ptr, WORD);
+            if (!rt_take(sig, info.ssi_pid, word))
+                return;
+        }
+    }
+
+    int res = -1;
+
+    struct sigaction act = {};
+    act.sa_sigaction = handler_data;
+    act.sa_flags = SA_SIGINFO;
+    sigemptyset(&act.sa_mask);
+    sigaddset(&act.sa_mask, SIG_DATA);
+    sigaddset(&act.sa_mask, SIG_LAST);
+    res = sigaction(SIG_DATA, &act, NULL);
+    error_check("wr sigaction data", res);
+    res = sigaction(SIG_LAST, &act, NULL);
+    error_check("wr sigaction last", res);
+
+    while (1)
+    {
+        rt_acks();
+        sigsuspend(&oldmask);
+        if (errno != EINTR)
+            error_check("wr sigsuspend", -1);
+        stats.waits++;
+
+        for (int i = 0; i < nwords; i++)
+            if (!rt_take(word_sigs[i], word_pids[i], words[i]))
+                return;
+        nwords = 0;
+    }
+}
+
+
+/*  Puts a received word to the frame of its channel and acks every
+    ack_every of them, returns 0 after all channels are done
+*/
+int rt_take(int sig, pid_t pid, union sigval word)
+{
+    struct channel* ch = channel_of(pid);
+    unsigned char bytes[WORD];
+    memcpy(bytes, &word, WORD);
+
+    //tail after the end frame
+    if (ch->done)
+        return ndone < nchannels;
+
+    int more = 0;
+    if (sig == SIG_LAST)
+    {
+        if (frame_take(&ch->frame, (char*) bytes, bytes[PAYLOAD]))
+        {
+            fprintf(stderr, "%s: stream of %d ends without the end frame\n",
+                    progname, pid);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        if (bytes[PAYLOAD] != (ch->nrecv & 0xFF))
+        {
+            fprintf(stderr, "%s: word %u of %d has sequence number %d\n",
+                    progname, ch->nrecv, pid, bytes[PAYLOAD]);
+            exit(EXIT_FAILURE);
+        }
+        more = frame_take(&ch->frame, (char*) bytes, PAYLOAD);
+        if (more && ++ch->nrecv % ack_every == 0)
+            rt_ack(ch);
+    }
+
+    if (!more)
+    {
+        ch->done = 1;
+        ndone++;
+    }
+
+    return ndone < nchannels;
+}
+
+
+/*  Ack which does not fit to the full signal queue is sent later
+*/
+void rt_ack(struct channel* ch)
+{
+    union sigval val;
+    val.sival_int = ch->nrecv;
+    int res = sigqueue(ch->pid, SIG_ACK, val);
+    if (res == -1 && errno == EAGAIN)
+    {
+        ch->ack_due = 1;
+        stats.retries++;
+        return;
+    }
+    error_check("wr sigqueue", res);
+    ch->ack_due = 0;
+    stats.signals++;
+}
+
+
+int rt_acks()
+{
+    int due = 0;
+    for (int i = 0; channels && i < nchannels; i++)
+    {
+        if (channels[i].ack_due && !channels[i].done)
+            rt_ack(channels + i);
+        due += channels && channels[i].ack_due && !channels[i].done;
+    }
+
+    return due;
+}
+
+
+struct channel* channel_of(pid_t pid)
+{
+    for (int i = 0; i < nchannels; i++)
+        if (channels[i].pid == pid)
+            return channels + i;
+
+    fprintf(stderr, "%s: signal from unknown process %d\n", progname, pid);
+    exit(EXIT_FAILURE);
+}
+
+
+void handler_data(int sig, siginfo_t* info, void* ctx)
+{
+    (void) ctx;
+
+    word_sigs[nwords] = sig;
+    word_pids[nwords] = info->si_pid;
+    words[nwords++] = info->si_value;
+}
+
+
+void handler_ack(int sig, siginfo_t* info, void* ctx)
+{
+    (void) sig;
+    (void) ctx;
+
+    acked = info->si_value.sival_int;
+}
+
+
+void stats_report(const char* who)
+{
+    long nsys = stats.signals + stats.waits + stats.reads + stats.writes;
+    double mb = stats.bytes / (1024.0 * 1024.0);
+    fprintf(stderr, "%s: %ld bytes, %ld signals, %ld waits, %ld reads, %ld writes, "
+            "%ld retries, %.3lf syscalls per byte, %.3lf signals per MB\n", who, stats.bytes,
+            stats.signals, stats.waits, stats.reads, stats.writes, stats.retries,
+            stats.bytes ? (double) nsys / stats.bytes : 0.0,
+            stats.bytes ? stats.signals / mb : 0.0);
+}
+
+
+void init_sync()
+{
+    sfd = signalfd(-1, &blocked, SFD_NONBLOCK | SFD_CLOEXEC);
+    error_check("signalfd", sfd);
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    error_check("epoll_create1", efd);
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = sfd;
+    int res = epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+    error_check("epoll_ctl", res);
+}
+
+
+/*  Next signal from signalfd, pending ones are read at once. Output
+    is written when no signal comes for FLUSH_MS or the buffer is full
+*/
+int next_sig(struct signalfd_siginfo* info)
+{
+    while (iinfo == ninfos)
+    {
+        int res = read(sfd, infos, sizeof(infos));
+        stats.reads++;
+        if (res > 0)
+        {
+            ninfos = res / sizeof(infos[0]);
+            iinfo = 0;
+            break;
+        }
+        if (errno != EAGAIN)
+            error_check("signalfd read", -1);
+
+        //acks wait here for room in the signal queue
+        int due = rt_acks();
+        struct epoll_event ev;
+        res = epoll_wait(efd, &ev, 1, nout || due ? FLUSH_MS : -1);
+        stats.waits++;
+        if (res == -1 && errno == EINTR)
+            continue;
+        error_check("epoll_wait", res);
+        if (!res)
+            out_flush();
+    }
+
+    *info = infos[iinfo++];
+    return info->ssi_signo;
+}
+
+
+void out_put(const void* data, int n)
+{
+    if (nout + n > OUT_SIZE)
+        out_flush();
+    memcpy(out + nout, data, n);
+    nout += n;
+}
+
+
+void out_flush()
+{
+    for (int done = 0; done < nout; )
+    {
+        int res = write(STDOUT_FILENO, out + done, nout - done);
+        error_check("write", res);
+        stats.writes++;
+        stats.bytes += res;
+        done += res;
+    }
+    nout = 0;
+}